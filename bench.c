@@ -0,0 +1,91 @@
+/* benchmark harness,run bench.lua in a lua state with lua_bson linked
+ * statically.it count bytes allocated by lua,bench.lua read it by the
+ * global function bench_counters.libbson allocations are counted by
+ * stats(),as lua_bson own the libbson vtable
+ *
+ * gcc -O2 -o lbs_bench bench.c lbson.c -I/usr/local/include/libbson-1.0
+ *     -lbson-1.0 -llua -lm -ldl
+ * ./lbs_bench [times] [text|csv]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <bson.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "lbson.h"
+
+#define BENCH_SCRIPT "bench.lua"
+
+static lua_Integer lua_bytes = 0;
+
+/* osize is the type of object when ptr is NULL,count new and grown blocks */
+static void *count_alloc( void *ud,void *ptr,size_t osize,size_t nsize )
+{
+    (void)ud;
+    if ( 0 == nsize )
+    {
+        free( ptr );
+        return NULL;
+    }
+
+    if ( !ptr || nsize > osize ) lua_bytes += (lua_Integer)nsize;
+
+    return realloc( ptr,nsize );
+}
+
+/* bytes = bench_counters() */
+static int bench_counters( lua_State *L )
+{
+    lua_pushinteger( L,lua_bytes );
+
+    return 1;
+}
+
+static int panic( lua_State *L )
+{
+    fprintf( stderr,"lua panic:%s\n",lua_tostring( L,-1 ) );
+    return 0;
+}
+
+int main( int argc,char *argv[] )
+{
+    lua_State *L = lua_newstate( count_alloc,NULL );
+    if ( !L )
+    {
+        fprintf( stderr,"can not create lua state\n" );
+        return 1;
+    }
+    lua_atpanic( L,panic );
+
+    luaL_openlibs( L );
+    luaL_requiref( L,"lua_bson",luaopen_lua_bson,0 );
+    lua_pop( L,1 );
+
+    lua_register( L,"bench_counters",bench_counters );
+
+    /* arg table as the standalone lua interpreter */
+    lua_createtable( L,argc,1 );
+    lua_pushstring( L,BENCH_SCRIPT );
+    lua_rawseti( L,-2,0 );
+    for ( int i = 1;i < argc;i ++ )
+    {
+        lua_pushstring( L,argv[i] );
+        lua_rawseti( L,-2,i );
+    }
+    lua_setglobal( L,"arg" );
+
+    int ret = 0;
+    if ( LUA_OK != luaL_dofile( L,BENCH_SCRIPT ) )
+    {
+        fprintf( stderr,"%s\n",lua_tostring( L,-1 ) );
+        ret = 1;
+    }
+
+    lua_close( L );
+
+    return ret;
+}
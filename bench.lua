@@ -0,0 +1,328 @@
+-- performance benchmark for lua_bson
+-- usage: lua bench.lua [times] [text|csv]
+-- or build the c harness by "make bench",which also report exact bytes
+-- allocated by lua per op
+
+local bson = require "lua_bson"
+
+local TIMES  = tonumber( arg and arg[1] ) or 100000
+local FORMAT = arg and arg[2] or "text"
+
+-- ops run with gc stopped to measure memory per op
+local SAMPLE = 1000
+
+-- provided by bench.c,return bytes allocated by lua
+local counters = rawget( _G,"bench_counters" )
+
+-- build a nested table like player state,depth levels deep
+local function make_nested( depth )
+    local tbl = { id = depth,name = "level" .. depth,hp = 998.77,flag = true }
+    if depth > 1 then
+        tbl.child = make_nested( depth - 1 )
+        tbl.list  = { 1,2,3,make_nested( 1 ) }
+    end
+
+    return tbl
+end
+
+-- memory per op.libbson allocations are counted by stats,which is enabled
+-- only for the sample and restored after,as a section may toggle it too
+local function measure( times,func )
+    local sample = math.min( times,SAMPLE )
+
+    collectgarbage( "collect" )
+    collectgarbage( "stop" )
+
+    local enabled = bson.stats().enabled
+    bson.enable_stats( true )
+    local alloc = bson.stats().alloc
+
+    local kb = collectgarbage( "count" )
+    local bytes = counters and counters()
+
+    for _ = 1,sample do func() end
+
+    local gc_bytes
+    if counters then
+        gc_bytes = ( counters() - bytes ) / sample
+    else
+        gc_bytes = ( collectgarbage( "count" ) - kb ) * 1024 / sample
+    end
+
+    local cur = bson.stats().alloc
+    bson.enable_stats( enabled )
+
+    collectgarbage( "restart" )
+    return ( cur.count - alloc.count ) / sample,
+        ( cur.bytes - alloc.bytes ) / sample,gc_bytes
+end
+
+if "csv" == FORMAT then
+    print( "name,ops,ops_per_sec,mb_per_sec,allocs_per_op,"
+        .. "alloc_bytes_per_op,gc_bytes_per_op" )
+end
+
+local function bench( name,times,func )
+    times = math.max( 1,math.floor( times ) )
+
+    local allocs,alloc_bytes,gc_bytes = measure( times,func )
+    collectgarbage( "collect" )
+
+    local bytes = 0
+    local beg = os.clock()
+    for _ = 1,times do
+        bytes = bytes + func()
+    end
+    local sec = os.clock() - beg
+    if sec <= 0 then sec = 1e-9 end
+
+    local ops,mb = times / sec,bytes / sec / 1024 / 1024
+    if "csv" == FORMAT then
+        print( string.format( "%s,%d,%.0f,%.2f,%.2f,%.0f,%.0f",
+            name,times,ops,mb,allocs,alloc_bytes,gc_bytes ) )
+    else
+        print( string.format( "%-24s %10d ops %10.0f ops/s %8.2f MB/s "
+            .. "%8.2f allocs/op %8.0f alloc B/op %8.0f gc B/op",
+            name,times,ops,mb,allocs,alloc_bytes,gc_bytes ) )
+    end
+end
+
+local function set_array( tb,flag )
+    return setmetatable( tb,{ __array = flag } )
+end
+
+-- representative corpora,each run encode,decode,encode_stack,decode_stack
+local flat = { id = 1024,name = "player",level = 60,exp = 123456789012,
+    hp = 998.77,mp = 12.5,vip = true,guild = "guild name",
+    login = 1500000000,logout = 1500003600,online = false,money = 99999 }
+
+local numbers = {}
+for i = 1,10000 do numbers[i] = i * 3 end
+
+local strings = {}
+for i = 1,100 do strings["key" .. i] = string.rep( string.char( 64 + i % 26 ),64 ) end
+
+local sparse,forced = {},{}
+for i = 1,100 do
+    sparse[i * 10] = i
+    forced["k" .. i] = i
+end
+set_array( forced,true )
+
+local corpora =
+{
+    { "flat",flat,1 },
+    { "nested",make_nested( 10 ),1 },
+    { "numbers",{ data = numbers },100 },
+    { "strings",strings,10 },
+    { "sparse",{ data = sparse },1 },
+    { "forced",{ data = forced },1 },
+}
+
+for _,corpus in ipairs( corpora ) do
+    local name,tbl,scale = corpus[1],corpus[2],corpus[3]
+    local times = TIMES / scale
+
+    local buffer = bson.encode( tbl )
+    local stack_buffer = bson.encode_stack( false,tbl )
+
+    bench( "encode " .. name,times,function()
+        return string.len( bson.encode( tbl ) )
+    end )
+    bench( "decode " .. name,times,function()
+        bson.decode( buffer )
+        return string.len( buffer )
+    end )
+    bench( "encode_stack " .. name,times,function()
+        return string.len( bson.encode_stack( false,tbl ) )
+    end )
+    bench( "decode_stack " .. name,times,function()
+        bson.decode_stack( stack_buffer )
+        return string.len( stack_buffer )
+    end )
+end
+
+local dense,mixed = {},{}
+for i = 1,100 do
+    dense[i] = i
+    mixed[i] = i
+end
+mixed.name = "mixed"
+
+-- ordered lists,so csv rows keep the same order across runs
+for _,corpus in ipairs( { { "dense",dense },{ "mixed",mixed } } ) do
+    local name,tbl = corpus[1],corpus[2]
+    local wrap = { data = tbl }
+    bench( "encode " .. name .. " array",TIMES,function()
+        return string.len( bson.encode( wrap ) )
+    end )
+end
+
+for _,depth in ipairs( { 1,5,6,7,8,9,10 } ) do
+    local tbl = make_nested( depth )
+    local buffer = bson.encode( tbl )
+
+    bench( "encode nested " .. depth,TIMES,function()
+        return string.len( bson.encode( tbl ) )
+    end )
+    local encoder = bson.encoder()
+    bench( "encoder nested " .. depth,TIMES,function()
+        return string.len( encoder:encode( tbl ) )
+    end )
+    bench( "decode nested " .. depth,TIMES,function()
+        bson.decode( buffer )
+        return string.len( buffer )
+    end )
+end
+
+-- many documents with the same schema,the case key cache is designed for
+local records = {}
+for i = 1,100 do
+    records[i] = { user_id = i,user_name = "name" .. i,login_time = i * 7,
+        level = i % 60,guild_name = "guild",vip = i % 2 == 0 }
+end
+local records_buffer = bson.encode( { records = records } )
+bench( "decode records",TIMES / 10,function()
+    bson.decode( records_buffer )
+    return string.len( records_buffer )
+end )
+bson.key_cache( 1024 )
+bench( "decode records cached",TIMES / 10,function()
+    bson.decode( records_buffer )
+    return string.len( records_buffer )
+end )
+bson.key_cache( 0 )
+
+local large = {}
+for i = 1,100000 do large[i] = i * 0.5 end
+local large_buffer = bson.encode( { data = large } )
+bench( "decode 100k array",TIMES / 1000,function()
+    bson.decode( large_buffer )
+    return string.len( large_buffer )
+end )
+
+local schema = { id = "integer",name = "string",hp = "double",flag = "boolean",
+    pos = { x = "double",y = "double",z = "double" },list = "any" }
+local message = { id = 1024,name = "player",hp = 998.77,flag = true,
+    pos = { x = 1.5,y = 2.5,z = 3.5 },list = { 1,2,3 } }
+local codec = bson.compile( schema )
+local message_buffer = codec:encode( message )
+bench( "encode message",TIMES,function()
+    return string.len( bson.encode( message ) )
+end )
+bench( "codec encode message",TIMES,function()
+    return string.len( codec:encode( message ) )
+end )
+bench( "decode message",TIMES,function()
+    bson.decode( message_buffer )
+    return string.len( message_buffer )
+end )
+bench( "codec decode message",TIMES,function()
+    codec:decode( message_buffer )
+    return string.len( message_buffer )
+end )
+
+local io_buffer = bson.buffer( 64 * 1024 )
+local io_len = bson.encode_into( io_buffer,0,message )
+bench( "encode_into message",TIMES,function()
+    return bson.encode_into( io_buffer,0,message )
+end )
+bench( "decode_from message",TIMES,function()
+    bson.decode_from( io_buffer,false,0,io_len )
+    return io_len
+end )
+
+-- sustained encode/decode with each memory backend.malloc is libbson
+-- allocations not served by the pool free list
+collectgarbage( "collect" )
+local sustained = make_nested( 5 )
+local sustained_buffer = bson.encode( sustained )
+for _,backend in ipairs( { "system","lua","pool" } ) do
+    bson.memory( backend )
+    bson.enable_stats( true )
+    bson.reset_stats()
+    bench( "memory " .. backend,TIMES,function()
+        bson.decode( sustained_buffer )
+        return string.len( bson.encode( sustained ) )
+    end )
+    local alloc = bson.stats().alloc
+    bson.enable_stats( false )
+    if "csv" ~= FORMAT then
+        print( string.format( "%-24s %10d malloc %10d reuse",
+            "memory " .. backend,alloc.count - alloc.reuse,alloc.reuse ) )
+    end
+end
+bson.memory( "system" )
+
+-- bulk load,decode_all in lua thread vs decode_batch on worker threads
+local bulk = {}
+for i = 1,10000 do bulk[i] = bson.encode( make_nested( 3 ) ) end
+bulk = table.concat( bulk )
+bench( "decode_all bulk",TIMES / 10000,function()
+    bson.decode_all( bulk )
+    return string.len( bulk )
+end )
+for _,threads in ipairs( { 1,2,4,8 } ) do
+    bench( "decode_batch bulk " .. threads,TIMES / 10000,function()
+        bson.decode_batch( bulk,false,threads )
+        return string.len( bulk )
+    end )
+end
+
+-- world dump,encode on lua thread vs encode_async.async time is the
+-- snapshot cost the lua thread pays
+local world = {}
+for i = 1,1000 do world[i] = make_nested( 3 ) end
+local world_writer = bson.writer()
+bench( "writer world",TIMES / 10000,function()
+    for _,tbl in ipairs( world ) do world_writer:append( tbl ) end
+    local size = world_writer:size()
+    world_writer:flush( function() end )
+    return size
+end )
+world_writer = nil
+bench( "encode_async snapshot",TIMES / 10000,function()
+    bson.encode_async( world )
+    return 0
+end )
+for _,threads in ipairs( { 1,4 } ) do
+    bench( "encode_async world " .. threads,TIMES / 10000,function()
+        return string.len( bson.encode_async( world,false,nil,threads ):result() )
+    end )
+end
+
+-- decode with utf-8 validation,ascii and multi-byte strings
+local validate = { validate = true }
+local unicode = {}
+for i = 1,100 do unicode["键" .. i] = string.rep( "中文ü",16 ) end
+for _,corpus in ipairs( { { "strings",strings },{ "unicode",unicode } } ) do
+    local name,tbl = corpus[1],corpus[2]
+    local buffer = bson.encode( tbl )
+    bench( "decode " .. name,TIMES / 10,function()
+        bson.decode( buffer )
+        return string.len( buffer )
+    end )
+    bench( "decode " .. name .. " validate",TIMES / 10,function()
+        bson.decode( buffer,false,nil,nil,validate )
+        return string.len( buffer )
+    end )
+end
+
+-- typed values,the common types should not be slower for it
+local mongo = {}
+for i = 1,100 do
+    mongo[i] = { _id = bson.value( "oid" ),ts = bson.value( "timestamp",i,1 ),
+        at = bson.value( "date",i * 1000 ),name = "name" .. i,count = i }
+end
+local mongo_buffer = bson.encode( { data = mongo } )
+bench( "encode typed",TIMES / 10,function()
+    return string.len( bson.encode( { data = mongo } ) )
+end )
+bench( "decode typed",TIMES / 10,function()
+    bson.decode( mongo_buffer,false,nil,nil,{ typed = true } )
+    return string.len( mongo_buffer )
+end )
+bench( "decode untyped",TIMES / 10,function()
+    bson.decode( mongo_buffer )
+    return string.len( mongo_buffer )
+end )
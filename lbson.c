@@ -3,44 +3,172 @@
 #include <stdio.h> /* for snprintf */
 #include <math.h>  /* for floor */
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
 
 #define MAX_LUA_STACK   1024
 #define MAX_KEY_LENGTH  64
 #define MAX_ARRAY_INDEX INT_MAX
 #define ARRAY_KEY       "__array"
 
-#define ERROR_LOG(ector,...)    \
-    do{snprintf( ector->what,LBS_MAX_ERROR_MSG,__VA_ARGS__ );}while(0)
+#define ERROR_LOG(ector,k,...)    \
+    do{ector->kind = k;     \
+        snprintf( ector->what,LBS_MAX_ERROR_MSG,__VA_ARGS__ );}while(0)
 
 
+/* state of one encode call */
+struct encode_ctx
+{
+    struct error_collector *ec;
+    const void *array_mt; /* last metatable looked up for __array */
+    int array_mt_flag;    /* __array of array_mt */
+    int depth;            /* depth of current table,root is 1 */
+    int max_depth;
+    struct ref_set *refs; /* tables seen,NULL if ENCODE_REFS/STRICT not set */
+    struct canon_keys *canon; /* sorted keys,NULL if ENCODE_CANONICAL not set */
+};
+
+#define ENCODE_REFS      1 /* a table seen again is encoded as a reference */
+#define ENCODE_STRICT    2 /* error on a table which contain itself */
+#define ENCODE_CANONICAL 4 /* object keys in sorted order */
+
+/* value of metafield __array */
+#define ARRAY_UNSET  -1
+#define ARRAY_OBJECT  0
+#define ARRAY_FORCE   1
+
+#define ENCODE_CTX_INIT(ctx,ector)    \
+    do{ (ctx)->ec = ector;(ctx)->array_mt = NULL;(ctx)->array_mt_flag = 0; \
+        (ctx)->depth = 0;(ctx)->max_depth = 0;(ctx)->refs = NULL; \
+        (ctx)->canon = NULL; }while(0)
+
+/* statistics of encode/decode,shared by all lua states.only updated when
+ * enabled by enable_stats,so a disabled one cost a branch per call
+ */
+enum
+{
+    STATS_ENCODE = 0,
+    STATS_DECODE,
+    STATS_ENCODE_STACK,
+    STATS_DECODE_STACK,
+
+    STATS_OP_MAX
+};
+
+#define STATS_MAX_DEPTH 16 /* the last slot of histogram count deeper ones */
+
+struct stats_op
+{
+    lua_Integer calls;
+    lua_Integer errors;
+    lua_Integer errors_by_kind[LBS_ERROR_MAX];
+    lua_Integer bytes;
+    double time;       /* seconds */
+};
+
+struct lbs_stats
+{
+    struct stats_op op[STATS_OP_MAX];
+    lua_Integer depth[STATS_MAX_DEPTH];
+
+    /* updated by libbson allocations,which may be in other threads */
+    lua_Integer alloc_count;
+    lua_Integer alloc_bytes;
+    lua_Integer free_count;
+    lua_Integer pool_reuse; /* allocations served by pool free list */
+};
+
+static int stats_enabled = 0;
+static struct lbs_stats stats;
+
+/* encoder,writer,reader and typed values alive,they hold libbson memory
+ * across calls
+ */
+static int mem_holders = 0;
+
+/* holders are created and collected by every lua state */
+#define MEM_HOLD()   __atomic_add_fetch( &mem_holders,1,__ATOMIC_RELAXED )
+#define MEM_UNHOLD() __atomic_sub_fetch( &mem_holders,1,__ATOMIC_RELAXED )
+
+static inline double stats_clock()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC,&ts );
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* kind is the error_collector kind if err < 0 */
+static void stats_record( int op,
+    double beg,int err,int kind,size_t bytes,int depth )
+{
+    struct stats_op *so = stats.op + op;
+
+    ++so->calls;
+    so->time += stats_clock() - beg;
+    if ( err < 0 )
+    {
+        ++so->errors;
+        ++so->errors_by_kind[kind];
+        return;
+    }
+
+    so->bytes += (lua_Integer)bytes;
+    if ( depth > 0 )
+    {
+        ++stats.depth[ depth > STATS_MAX_DEPTH ? STATS_MAX_DEPTH - 1 : depth - 1 ];
+    }
+}
+
+/* get metafield __array of the table at index,return ARRAY_FORCE if it's
+ * true,ARRAY_OBJECT if it's false or ARRAY_UNSET.
+ * tables of the same class share one metatable,so the result is cached by
+ * metatable.no lua code run while encoding,the metatable can't be changed
+ * and stay reachable during the whole encode
+ */
+static int array_metafield( lua_State *L,int index,struct encode_ctx *ctx )
+{
+    if ( !lua_getmetatable( L,index ) ) return ARRAY_UNSET;
+
+    const void *mt = lua_topointer( L,-1 );
+    if ( mt != ctx->array_mt )
+    {
+        int flag = ARRAY_UNSET;
+
+        lua_pushliteral( L,ARRAY_KEY );
+        if ( LUA_TNIL != lua_rawget( L,-2 ) )
+        {
+            flag = lua_toboolean( L,-1 ) ? ARRAY_FORCE : ARRAY_OBJECT;
+        }
+        lua_pop( L,1 );
+
+        ctx->array_mt = mt;
+        ctx->array_mt_flag = flag;
+    }
+
+    lua_pop( L,1 ); /* pop metatable */
+    return ctx->array_mt_flag;
+}
+
 /* check if a lua table is a array
  * 1.all key is integer
- * 2.metafield __array is true
+ * 2.metafield __array is true(flag is ARRAY_FORCE)
  */
-static int is_array( lua_State *L,int index,int *array,int *max_index )
+static int is_array( lua_State *L,int index,int flag,int *array,int *max_index )
 {
     double key = 0;
     assert( array && max_index );
 
     /* set default value */
-    *array = 0;
+    *array = ( ARRAY_FORCE == flag );
     *max_index = -1;
 
-    if ( luaL_getmetafield( L,index,ARRAY_KEY ) )
-    {
-        if ( LUA_TNIL != lua_type( L,-1 ) )
-        {
-            if ( lua_toboolean( L,-1 ) )
-                *array = 1;
-            else
-            {
-                lua_pop( L,1 );
-                return 0;  /* it's object,use default value */
-            }
-        }
-
-        lua_pop( L,1 );    /* pop metafield value */
-    }
+    if ( ARRAY_OBJECT == flag ) return 0;
 
     /* get max array index */
     lua_pushnil( L );
@@ -84,620 +212,7477 @@ static int is_array( lua_State *L,int index,int *array,int *max_index )
     return 0;
 }
 
+/* array index key "0","1",... are formatted once(see lbs_init_once) and
+ * shared by all lua states.key beyond the table use fast_itoa
+ */
+#define INDEX_KEY_MAX  10000
+#define INDEX_KEY_SIZE 5      /* "9999" + '\0' */
+#define INTEGER_KEY_SIZE 24   /* enough for a int64 with sign */
+
+static char index_keys[INDEX_KEY_MAX][INDEX_KEY_SIZE];
+
+/* convert a integer into decimal string,return the string length */
+static int fast_itoa( char *buffer,lua_Integer val )
+{
+    char tmp[INTEGER_KEY_SIZE];
+    char *pos = tmp + sizeof(tmp);
+    lua_Unsigned uval = val < 0 ?
+        (lua_Unsigned)0 - (lua_Unsigned)val : (lua_Unsigned)val;
+
+    do
+    {
+        *(--pos) = (char)('0' + uval % 10);
+        uval /= 10;
+    } while ( uval );
+
+    if ( val < 0 ) *(--pos) = '-';
+
+    int len = (int)(tmp + sizeof(tmp) - pos);
+    memcpy( buffer,pos,len );
+    buffer[len] = 0;
+
+    return len;
+}
+
+static void index_key_init()
+{
+    for ( int i = 0;i < INDEX_KEY_MAX;i ++ )
+    {
+        fast_itoa( index_keys[i],i );
+    }
+}
+
+/* get a bson array key of index(start from 0).buffer is used if the index
+ * is not in the table,it must be at least INTEGER_KEY_SIZE bytes
+ */
+static inline const char *index_key( int index,char *buffer,int *len )
+{
+    if ( index < INDEX_KEY_MAX )
+    {
+        *len = index < 10 ? 1 : index < 100 ? 2 : index < 1000 ? 3 : 4;
+        return index_keys[index];
+    }
+
+    *len = fast_itoa( buffer,index );
+    return buffer;
+}
+
 /* check a integer is int32 or int64 */
 static inline int lua_isbit32(int64_t v)
 {
     return v >= INT_MIN && v <= INT_MAX;
 }
 
-int bson_decode( lua_State*L,bson_iter_t *iter,
-    bson_type_t root_type,struct error_collector *ec );
+/* decoded object keys are interned into lua strings by lua_setfield again
+ * and again,while documents repeat the same few keys.the key cache map raw
+ * key bytes to lua strings already created.it's a direct mapped table of
+ * size slots(a new key evict the old one in the same slot),the strings are
+ * kept in the uservalue of the cache userdata.the cache is stored in
+ * registry,so it's per lua state
+ */
+#define KEY_CACHE_MAX_KEY    32      /* longer keys are not cached */
+#define KEY_CACHE_MAX_SIZE   65536
 
-int value_encode( lua_State *L,bson_t *doc,
-    const char *key,int index,struct error_collector *ec )
+struct key_slot
 {
-    int ty = lua_type( L,index );
-    switch ( ty )
-    {
-        case LUA_TNIL :
-        {
-            BSON_APPEND_NULL( doc,key );
-        }break;
-        case LUA_TBOOLEAN :
-        {
-            int val = lua_toboolean( L,index );
-            BSON_APPEND_BOOL( doc,key,val );
-        }break;
-        case LUA_TNUMBER :
-        {
-            if ( lua_isinteger( L,index ) )
-            {
-                /* int32 or int64 */
-                lua_Integer val = lua_tointeger( L,index );
-                if ( lua_isbit32( val ) )
-                    BSON_APPEND_INT32( doc,key,(int)val );
-                else
-                    BSON_APPEND_INT64( doc,key,val );
-            }
-            else
-            {
-                double val = lua_tonumber( L,index );
-                BSON_APPEND_DOUBLE( doc,key,val );
-            }
-        }break;
-        case LUA_TSTRING :
-        {
-            const char *val = lua_tostring( L,index );
-            BSON_APPEND_UTF8( doc,key,val );
-        }break;
-        case LUA_TTABLE :
-        {
-            int array = 0;
-            bson_t *sub_doc = lbs_do_encode( L,index,&array,ec );
-            if ( !sub_doc ) return -1;
+    uint32_t hash;
+    int len;                         /* -1 if slot not used */
+    char key[KEY_CACHE_MAX_KEY];
+};
 
-            if ( array ) BSON_APPEND_ARRAY( doc,key,sub_doc );
-            else BSON_APPEND_DOCUMENT( doc,key,sub_doc );
-            bson_destroy( sub_doc );
-        }break;
-        default :
-        {
-            ERROR_LOG( ec,"value_encode can not convert %s to bson value\n",
-                lua_typename(L,ty) );
-            return -1;
-        }break;
+struct key_cache
+{
+    uint32_t size;                   /* slot count,power of 2 */
+    uint32_t used;
+    lua_Integer hits;
+    lua_Integer misses;
+    lua_Integer evictions;
+    struct key_slot slots[1];
+};
+
+/* state of one decode call */
+struct decode_ctx
+{
+    struct error_collector *ec;
+    struct key_cache *cache;
+    int cache_index;                 /* stack index of cached strings */
+    int depth;                       /* depth of current table,root is 1 */
+    int max_depth;
+    int flags;                       /* DECODE_* */
+    int ref_index;                   /* stack index of tables by id */
+    int ref_count;
+};
+
+#define DECODE_VALIDATE 1 /* check utf-8 of keys and strings,and corruption */
+#define DECODE_TYPED    2 /* oid and date_time as typed value too */
+#define DECODE_REFS     4 /* resolve references written by ENCODE_REFS */
+
+static const char key_cache_key = 0; /* registry key of key cache */
+
+/* find the key cache of L and push it's strings table */
+static void decode_ctx_init( lua_State *L,
+    struct decode_ctx *ctx,struct error_collector *ec )
+{
+    ctx->ec = ec;
+    ctx->cache = NULL;
+    ctx->cache_index = 0;
+    ctx->depth = 0;
+    ctx->max_depth = 0;
+    ctx->flags = 0;
+    ctx->ref_index = 0;
+    ctx->ref_count = 0;
+
+    if ( LUA_TUSERDATA != lua_rawgetp( L,LUA_REGISTRYINDEX,&key_cache_key ) )
+    {
+        lua_pop( L,1 );
+        return;
     }
 
-    return 0;
+    ctx->cache = (struct key_cache *)lua_touserdata( L,-1 );
+    lua_getuservalue( L,-1 );
+    lua_remove( L,-2 );
+    ctx->cache_index = lua_gettop( L );
 }
 
-int value_decode( lua_State*L,bson_iter_t *iter,struct error_collector *ec )
+/* remove the strings table pushed by decode_ctx_init,and tables by id if
+ * DECODE_REFS,values above them are kept
+ */
+static void decode_ctx_done( lua_State *L,struct decode_ctx *ctx )
 {
-    switch ( bson_iter_type( iter ) )
+    if ( ctx->ref_index && ctx->ref_index <= lua_gettop( L ) )
     {
-        case BSON_TYPE_DOUBLE    :
-        {
-            double val = bson_iter_double( iter );
-            lua_pushnumber( L,val );
-        }break;
-        case BSON_TYPE_DOCUMENT  :
-        {
-            bson_iter_t sub_iter;
-            if ( !bson_iter_recurse( iter, &sub_iter ) )
-            {
-                ERROR_LOG( ec,"bson document iter recurse error" );
-                return -1;
-            }
-            if ( bson_decode( L,&sub_iter,BSON_TYPE_DOCUMENT,ec ) < 0 )
-            {
-                return -1;
-            }
-        }break;
-        case BSON_TYPE_ARRAY     :
-        {
-            bson_iter_t sub_iter;
-            if ( !bson_iter_recurse( iter, &sub_iter ) )
-            {
-                ERROR_LOG( ec,"bson array iter recurse error" );
-                return -1;
-            }
-            if ( bson_decode( L,&sub_iter,BSON_TYPE_ARRAY,ec ) < 0 )
-            {
-                return -1;
-            }
-        }break;
-        case BSON_TYPE_BINARY    :
-        {
-            const char *val  = NULL;
-            unsigned int len = 0;
-            bson_iter_binary( iter,NULL,&len,(const uint8_t **)(&val) );
-            lua_pushlstring( L,val,len );
-        }break;
-        case BSON_TYPE_UTF8      :
-        {
-            unsigned int len = 0;
-            const char *val = bson_iter_utf8( iter,&len );
-            lua_pushlstring( L,val,len );
-        }break;
-        case BSON_TYPE_OID       :
-        {
-            const bson_oid_t *oid = bson_iter_oid ( iter );
-
-            char str[25];  /* bson api make it 25 */
-            bson_oid_to_string( oid, str );
-            lua_pushstring( L,str );
-        }break;
-        case BSON_TYPE_BOOL      :
-        {
-            bool val = bson_iter_bool( iter );
-            lua_pushboolean( L,val );
-        }break;
-        case BSON_TYPE_NULL      :
-        {
-            /* NULL == nil in lua */
-            lua_pushnil( L );
-        }break;
-        case BSON_TYPE_INT32     :
-        {
-            int val = bson_iter_int32( iter );
-            lua_pushinteger( L,val );
-        }break;
-        case BSON_TYPE_DATE_TIME :
-        {
-            /* A 64-bit integer containing the number of milliseconds since
-             * the UNIX epoch
-             */
-            int64_t val = bson_iter_date_time( iter );
-            lua_pushinteger( L,val );
-        }break;
-        case BSON_TYPE_INT64     :
-        {
-            int64_t val = bson_iter_int64( iter );
-            lua_pushinteger( L,val );
-        }break;
-        default :
-        {
-            ERROR_LOG( ec,"unknow bson type:%d",bson_iter_type( iter ) );
-            return -1;
-        }break;
+        lua_remove( L,ctx->ref_index );
     }
+    ctx->ref_index = 0;
 
-    return 0;
+    if ( ctx->cache_index && ctx->cache_index <= lua_gettop( L ) )
+    {
+        lua_remove( L,ctx->cache_index );
+    }
+    ctx->cache_index = 0;
 }
 
-bson_t *lbs_do_encode( lua_State *L,
-    int index,int *array,struct error_collector *ec )
+/* FNV-1a */
+static inline uint32_t key_hash( const char *key,int len )
 {
-    /* need 2 pos to iterate lua table */
-    if ( lua_gettop( L ) > MAX_LUA_STACK || !lua_checkstack( L,2 ) )
+    uint32_t hash = 2166136261u;
+    for ( int i = 0;i < len;i ++ )
     {
-        ERROR_LOG( ec,"stack overflow" );
-        return NULL;
+        hash = ( hash ^ (uint8_t)key[i] ) * 16777619u;
     }
 
-    int max_index  = -1;
-    int _is_array  =  0;
-    is_array( L,index,&_is_array,&max_index );
+    return hash;
+}
 
-    int stack_top = lua_gettop( L );
-    bson_t *doc = bson_new();
+/* push a object key as lua string,from the key cache if possible */
+static void push_key( lua_State *L,
+    const char *key,int len,struct decode_ctx *ctx )
+{
+    struct key_cache *cache = ctx->cache;
+    if ( !cache || len > KEY_CACHE_MAX_KEY )
+    {
+        lua_pushlstring( L,key,len );
+        return;
+    }
 
-    if ( _is_array )   /* encode array */
+    uint32_t hash = key_hash( key,len );
+    uint32_t index = hash & ( cache->size - 1 );
+    struct key_slot *slot = cache->slots + index;
+    if ( slot->len == len && slot->hash == hash
+        && 0 == memcmp( slot->key,key,len ) )
     {
-        if ( max_index > 0 ) /* a sparse array like { [10] = "foo" } */
-        {
-            char key[MAX_KEY_LENGTH] = { 0 };
-            int cur_index = 0;
-            /* lua array start from 1 */
-            for ( cur_index = 0;cur_index < max_index;cur_index ++ )
-            {
-                snprintf( key,MAX_KEY_LENGTH,"%d",cur_index );
-                lua_rawgeti( L, index, cur_index + 1 );
-                if ( value_encode( L,doc,key,stack_top + 1,ec ) < 0 )
-                {
-                    lua_pop( L,1 );
-                    bson_destroy( doc );
+        ++cache->hits;
+        lua_rawgeti( L,ctx->cache_index,index + 1 );
+        return;
+    }
 
-                    return NULL;
-                }
+    ++cache->misses;
+    if ( slot->len < 0 )
+        ++cache->used;
+    else
+        ++cache->evictions;
 
-                lua_pop( L,1 );
-            }
-        }
-        else
-        {
-            /* force a table(with string key) as a array */
-            int cur_index = 0;
-            char key[MAX_KEY_LENGTH] = { 0 };
+    slot->hash = hash;
+    slot->len  = len;
+    memcpy( slot->key,key,len );
 
-            lua_pushnil( L );
-            while ( lua_next( L,index) != 0 )
-            {
-                snprintf( key,MAX_KEY_LENGTH,"%d",cur_index++ );
-                if ( value_encode( L,doc,key,stack_top + 2,ec ) < 0 )
-                {
-                    lua_pop( L,2 );
-                    bson_destroy( doc );
+    lua_pushlstring( L,key,len );
+    lua_pushvalue( L,-1 );
+    lua_rawseti( L,ctx->cache_index,index + 1 );
+}
 
-                    return NULL;
-                }
+/* strict utf-8 validation for decode option validate.ascii runs are skipped
+ * by simd(avx2 or sse2,chosen at runtime),multi-byte sequences are checked
+ * one by one.overlong forms,surrogates and code points over U+10FFFF are
+ * invalid
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+    #include <immintrin.h>
+    #define UTF8_SIMD
+#endif
 
-                lua_pop( L,1 );
-            }
-        }
+typedef size_t (*ascii_span_t)( const uint8_t *str,size_t len );
+
+/* length of the leading ascii bytes,the scalar one check 8 bytes a time */
+static size_t ascii_span_scalar( const uint8_t *str,size_t len )
+{
+    size_t i = 0;
+    for ( ;i + 8 <= len;i += 8 )
+    {
+        uint64_t word;
+        memcpy( &word,str + i,sizeof(word) );
+        if ( word & 0x8080808080808080ULL ) break;
     }
-    else   /* encode object */
+    while ( i < len && str[i] < 0x80 ) ++i;
+
+    return i;
+}
+
+#ifdef UTF8_SIMD
+static size_t ascii_span_sse2( const uint8_t *str,size_t len )
+{
+    size_t i = 0;
+    for ( ;i + 16 <= len;i += 16 )
     {
-        lua_pushnil(L);  /* first key */
-        while ( lua_next(L, index) != 0 )
+        __m128i v = _mm_loadu_si128( (const __m128i *)( str + i ) );
+        if ( _mm_movemask_epi8( v ) ) break;
+    }
+    while ( i < len && str[i] < 0x80 ) ++i;
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_span_avx2( const uint8_t *str,size_t len )
+{
+    size_t i = 0;
+    for ( ;i + 32 <= len;i += 32 )
+    {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)( str + i ) );
+        if ( _mm256_movemask_epi8( v ) ) break;
+    }
+
+    return i + ascii_span_sse2( str + i,len - i );
+}
+#endif
+
+static ascii_span_t ascii_span = ascii_span_scalar;
+
+static void utf8_init()
+{
+#ifdef UTF8_SIMD
+    __builtin_cpu_init();
+    ascii_span = __builtin_cpu_supports( "avx2" ) ?
+        ascii_span_avx2 : ascii_span_sse2;
+#endif
+}
+
+/* check one multi-byte sequence,return it's length or 0 if invalid */
+static inline size_t utf8_sequence( const uint8_t *str,size_t len )
+{
+    uint8_t c = str[0];
+    if ( c >= 0xC2 && c <= 0xDF )
+    {
+        return len >= 2 && ( str[1] & 0xC0 ) == 0x80 ? 2 : 0;
+    }
+    if ( c >= 0xE0 && c <= 0xEF )
+    {
+        if ( len < 3 || ( str[2] & 0xC0 ) != 0x80 ) return 0;
+
+        /* E0 overlong,ED surrogates */
+        uint8_t lo = 0xE0 == c ? 0xA0 : 0x80;
+        uint8_t hi = 0xED == c ? 0x9F : 0xBF;
+        return str[1] >= lo && str[1] <= hi ? 3 : 0;
+    }
+    if ( c >= 0xF0 && c <= 0xF4 )
+    {
+        if ( len < 4 || ( str[2] & 0xC0 ) != 0x80
+            || ( str[3] & 0xC0 ) != 0x80 ) return 0;
+
+        /* F0 overlong,F4 over U+10FFFF */
+        uint8_t lo = 0xF0 == c ? 0x90 : 0x80;
+        uint8_t hi = 0xF4 == c ? 0x8F : 0xBF;
+        return str[1] >= lo && str[1] <= hi ? 4 : 0;
+    }
+
+    return 0;
+}
+
+static int utf8_valid( const char *str,size_t len )
+{
+    const uint8_t *ptr = (const uint8_t *)str;
+
+    size_t i = 0;
+    while ( i < len )
+    {
+        i += ascii_span( ptr + i,len - i );
+        if ( i >= len ) break;
+
+        size_t n = utf8_sequence( ptr + i,len - i );
+        if ( 0 == n ) return 0;
+
+        i += n;
+    }
+
+    return 1;
+}
+
+/* bson types without a lua counterpart(and oid,date_time,binary if decode
+ * option typed is set) decode as a userdata of LBS_VALUE holding a bson_value_t,
+ * and encode back as the same type.the common types never look at this
+ * table,value_encode and value_decode handle them in their switch
+ */
+#define LBS_VALUE "lua_bson.value"
+
+/* push the lua values of val,return the number of values pushed */
+typedef int (*value_push_t)( lua_State *L,const bson_value_t *val );
+/* fill val from arguments start at index,strings point into lua stack */
+typedef void (*value_make_t)( lua_State *L,int index,bson_value_t *val );
+
+struct value_type
+{
+    const char *name;
+    value_push_t push;  /* value:value() */
+    value_push_t text;  /* tostring,NULL to use push */
+    value_make_t make;  /* bson.value( name,... ) */
+    int owns;           /* bson_value_copy allocate memory for this type */
+};
+
+static int oid_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushlstring( L,(const char *)val->value.v_oid.bytes,12 );
+    return 1;
+}
+
+static int oid_text( lua_State *L,const bson_value_t *val )
+{
+    char str[25];
+    bson_oid_to_string( &val->value.v_oid,str );
+    lua_pushstring( L,str );
+    return 1;
+}
+
+/* 12 raw bytes,24 hex chars or none to generate a new one */
+static void oid_check( lua_State *L,int index,bson_oid_t *oid )
+{
+    size_t len = 0;
+    const char *str = luaL_optlstring( L,index,NULL,&len );
+    if ( !str )
+    {
+        bson_oid_init( oid,NULL );
+    }
+    else if ( 12 == len )
+    {
+        bson_oid_init_from_data( oid,(const uint8_t *)str );
+    }
+    else if ( 24 == len && bson_oid_is_valid( str,len ) )
+    {
+        bson_oid_init_from_string( oid,str );
+    }
+    else
+    {
+        luaL_argerror( L,index,"invalid object id" );
+    }
+}
+
+static void oid_make( lua_State *L,int index,bson_value_t *val )
+{
+    oid_check( L,index,&val->value.v_oid );
+}
+
+static int date_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushinteger( L,val->value.v_datetime );
+    return 1;
+}
+
+static void date_make( lua_State *L,int index,bson_value_t *val )
+{
+    val->value.v_datetime = luaL_checkinteger( L,index );
+}
+
+static int binary_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushlstring( L,(const char *)val->value.v_binary.data,
+        val->value.v_binary.data_len );
+    lua_pushinteger( L,val->value.v_binary.subtype );
+    return 2;
+}
+
+/* data and a optional subtype,generic binary(0) by default */
+static void binary_make( lua_State *L,int index,bson_value_t *val )
+{
+    size_t len = 0;
+    const char *data = luaL_checklstring( L,index,&len );
+    lua_Integer subtype =
+        luaL_optinteger( L,index + 1,BSON_SUBTYPE_BINARY );
+    luaL_argcheck( L,subtype >= 0 && subtype <= 0xFF,
+        index + 1,"invalid binary subtype" );
+    val->value.v_binary.data = (uint8_t *)data;
+    val->value.v_binary.data_len = (uint32_t)len;
+    val->value.v_binary.subtype = (bson_subtype_t)subtype;
+}
+
+static int regex_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushstring( L,val->value.v_regex.regex );
+    lua_pushstring( L,val->value.v_regex.options );
+    return 2;
+}
+
+static void regex_make( lua_State *L,int index,bson_value_t *val )
+{
+    val->value.v_regex.regex   = (char *)luaL_checkstring( L,index );
+    val->value.v_regex.options = (char *)luaL_optstring( L,index + 1,"" );
+}
+
+static int dbpointer_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushlstring( L,val->value.v_dbpointer.collection,
+        val->value.v_dbpointer.collection_len );
+    lua_pushlstring( L,(const char *)val->value.v_dbpointer.oid.bytes,12 );
+    return 2;
+}
+
+static int dbpointer_text( lua_State *L,const bson_value_t *val )
+{
+    char str[25];
+    bson_oid_to_string( &val->value.v_dbpointer.oid,str );
+    lua_pushlstring( L,val->value.v_dbpointer.collection,
+        val->value.v_dbpointer.collection_len );
+    lua_pushstring( L,str );
+    return 2;
+}
+
+static void dbpointer_make( lua_State *L,int index,bson_value_t *val )
+{
+    size_t len = 0;
+    val->value.v_dbpointer.collection =
+        (char *)luaL_checklstring( L,index,&len );
+    val->value.v_dbpointer.collection_len = (uint32_t)len;
+    luaL_checkstring( L,index + 1 );
+    oid_check( L,index + 1,&val->value.v_dbpointer.oid );
+}
+
+static int code_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushlstring( L,val->value.v_code.code,val->value.v_code.code_len );
+    return 1;
+}
+
+static void code_make( lua_State *L,int index,bson_value_t *val )
+{
+    size_t len = 0;
+    val->value.v_code.code = (char *)luaL_checklstring( L,index,&len );
+    val->value.v_code.code_len = (uint32_t)len;
+}
+
+static int symbol_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushlstring( L,val->value.v_symbol.symbol,val->value.v_symbol.len );
+    return 1;
+}
+
+static void symbol_make( lua_State *L,int index,bson_value_t *val )
+{
+    size_t len = 0;
+    val->value.v_symbol.symbol = (char *)luaL_checklstring( L,index,&len );
+    val->value.v_symbol.len = (uint32_t)len;
+}
+
+/* code and scope,scope is a bson buffer */
+static int codewscope_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushlstring( L,val->value.v_codewscope.code,
+        val->value.v_codewscope.code_len );
+    lua_pushlstring( L,(const char *)val->value.v_codewscope.scope_data,
+        val->value.v_codewscope.scope_len );
+    return 2;
+}
+
+static void codewscope_make( lua_State *L,int index,bson_value_t *val )
+{
+    size_t len = 0;
+    val->value.v_codewscope.code = (char *)luaL_checklstring( L,index,&len );
+    val->value.v_codewscope.code_len = (uint32_t)len;
+
+    bson_t scope;
+    const char *data = luaL_checklstring( L,index + 1,&len );
+    luaL_argcheck( L,bson_init_static( &scope,(const uint8_t *)data,len ),
+        index + 1,"invalid bson scope" );
+    val->value.v_codewscope.scope_data = (uint8_t *)data;
+    val->value.v_codewscope.scope_len = (uint32_t)len;
+}
+
+static int timestamp_push( lua_State *L,const bson_value_t *val )
+{
+    lua_pushinteger( L,val->value.v_timestamp.timestamp );
+    lua_pushinteger( L,val->value.v_timestamp.increment );
+    return 2;
+}
+
+static void timestamp_make( lua_State *L,int index,bson_value_t *val )
+{
+    val->value.v_timestamp.timestamp = (uint32_t)luaL_checkinteger( L,index );
+    val->value.v_timestamp.increment =
+        (uint32_t)luaL_checkinteger( L,index + 1 );
+}
+
+static int decimal128_push( lua_State *L,const bson_value_t *val )
+{
+    char str[BSON_DECIMAL128_STRING];
+    bson_decimal128_to_string( &val->value.v_decimal128,str );
+    lua_pushstring( L,str );
+    return 1;
+}
+
+static void decimal128_make( lua_State *L,int index,bson_value_t *val )
+{
+    const char *str = luaL_checkstring( L,index );
+    luaL_argcheck( L,bson_decimal128_from_string( str,&val->value.v_decimal128 ),
+        index,"invalid decimal128" );
+}
+
+/* undefined,minkey and maxkey have no value */
+static int none_push( lua_State *L,const bson_value_t *val )
+{
+    (void)L;
+    (void)val;
+    return 0;
+}
+
+static void none_make( lua_State *L,int index,bson_value_t *val )
+{
+    (void)L;
+    (void)index;
+    (void)val;
+}
+
+static const struct value_type value_types[256] =
+{
+    [BSON_TYPE_BINARY]     = { "binary",binary_push,NULL,binary_make,1 },
+    [BSON_TYPE_UNDEFINED]  = { "undefined",none_push,NULL,none_make,0 },
+    [BSON_TYPE_OID]        = { "oid",oid_push,oid_text,oid_make,0 },
+    [BSON_TYPE_DATE_TIME]  = { "date",date_push,NULL,date_make,0 },
+    [BSON_TYPE_REGEX]      = { "regex",regex_push,NULL,regex_make,1 },
+    [BSON_TYPE_DBPOINTER]  =
+        { "dbpointer",dbpointer_push,dbpointer_text,dbpointer_make,1 },
+    [BSON_TYPE_CODE]       = { "code",code_push,NULL,code_make,1 },
+    [BSON_TYPE_SYMBOL]     = { "symbol",symbol_push,NULL,symbol_make,1 },
+    [BSON_TYPE_CODEWSCOPE] =
+        { "codewscope",codewscope_push,NULL,codewscope_make,1 },
+    [BSON_TYPE_TIMESTAMP]  =
+        { "timestamp",timestamp_push,NULL,timestamp_make,0 },
+    [BSON_TYPE_DECIMAL128] =
+        { "decimal128",decimal128_push,NULL,decimal128_make,0 },
+    [BSON_TYPE_MAXKEY]     = { "maxkey",none_push,NULL,none_make,0 },
+    [BSON_TYPE_MINKEY]     = { "minkey",none_push,NULL,none_make,0 },
+};
+
+#define VALUE_TYPE( val ) ( value_types + (uint8_t)( val )->value_type )
+
+/* push a copy of val as a typed value userdata */
+static void value_new( lua_State *L,const bson_value_t *val )
+{
+    bson_value_t *copy =
+        (bson_value_t *)lua_newuserdata( L,sizeof(bson_value_t) );
+    bson_value_copy( val,copy );
+
+    /* memory of libbson backend alive in this userdata */
+    if ( VALUE_TYPE( val )->owns ) MEM_HOLD();
+    luaL_setmetatable( L,LBS_VALUE );
+}
+
+int bson_decode( lua_State*L,bson_iter_t *iter,
+    bson_type_t root_type,struct decode_ctx *ctx );
+
+static int table_encode( lua_State *L,bson_t *doc,const char *key,
+    int key_len,int index,int *array,struct encode_ctx *ctx );
+
+int value_encode( lua_State *L,bson_t *doc,
+    const char *key,int key_len,int index,struct encode_ctx *ctx )
+{
+    int ty = lua_type( L,index );
+    switch ( ty )
+    {
+        case LUA_TNIL :
+        {
+            bson_append_null( doc,key,key_len );
+        }break;
+        case LUA_TBOOLEAN :
+        {
+            int val = lua_toboolean( L,index );
+            bson_append_bool( doc,key,key_len,val );
+        }break;
+        case LUA_TNUMBER :
+        {
+            if ( lua_isinteger( L,index ) )
+            {
+                /* int32 or int64 */
+                lua_Integer val = lua_tointeger( L,index );
+                if ( lua_isbit32( val ) )
+                    bson_append_int32( doc,key,key_len,(int)val );
+                else
+                    bson_append_int64( doc,key,key_len,val );
+            }
+            else
+            {
+                double val = lua_tonumber( L,index );
+                bson_append_double( doc,key,key_len,val );
+            }
+        }break;
+        case LUA_TSTRING :
+        {
+            size_t len = 0;
+            const char *val = lua_tolstring( L,index,&len );
+            bson_append_utf8( doc,key,key_len,val,(int)len );
+        }break;
+        case LUA_TTABLE :
+        {
+            /* write the sub table straight into the parent buffer instead
+             * of encoding a standalone bson_t and copying it
+             */
+            if ( table_encode( L,doc,key,key_len,index,NULL,ctx ) < 0 )
+            {
+                return -1;
+            }
+        }break;
+        case LUA_TUSERDATA :
+        {
+            const bson_value_t *val =
+                (const bson_value_t *)luaL_testudata( L,index,LBS_VALUE );
+            if ( !val )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_TYPE,
+                    "value_encode can not convert %s to bson value\n",
+                    lua_typename(L,ty) );
+                return -1;
+            }
+            bson_append_value( doc,key,key_len,val );
+        }break;
+        default :
+        {
+            ERROR_LOG( ctx->ec,LBS_ERROR_TYPE,
+                "value_encode can not convert %s to bson value\n",
+                lua_typename(L,ty) );
+            return -1;
+        }break;
+    }
+
+    return 0;
+}
+
+int value_decode( lua_State*L,bson_iter_t *iter,struct decode_ctx *ctx )
+{
+    switch ( bson_iter_type( iter ) )
+    {
+        case BSON_TYPE_DOUBLE    :
+        {
+            double val = bson_iter_double( iter );
+            lua_pushnumber( L,val );
+        }break;
+        case BSON_TYPE_DOCUMENT  :
+        {
+            bson_iter_t sub_iter;
+            if ( !bson_iter_recurse( iter, &sub_iter ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "bson document iter recurse error" );
+                return -1;
+            }
+            if ( bson_decode( L,&sub_iter,BSON_TYPE_DOCUMENT,ctx ) < 0 )
+            {
+                return -1;
+            }
+        }break;
+        case BSON_TYPE_ARRAY     :
+        {
+            bson_iter_t sub_iter;
+            if ( !bson_iter_recurse( iter, &sub_iter ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "bson array iter recurse error" );
+                return -1;
+            }
+            if ( bson_decode( L,&sub_iter,BSON_TYPE_ARRAY,ctx ) < 0 )
+            {
+                return -1;
+            }
+        }break;
+        case BSON_TYPE_BINARY    :
+        {
+            /* keep the subtype when typed */
+            if ( ctx->flags & DECODE_TYPED )
+            {
+                value_new( L,bson_iter_value( iter ) );
+                break;
+            }
+
+            const char *val  = NULL;
+            unsigned int len = 0;
+            bson_iter_binary( iter,NULL,&len,(const uint8_t **)(&val) );
+            lua_pushlstring( L,val,len );
+        }break;
+        case BSON_TYPE_UTF8      :
+        {
+            unsigned int len = 0;
+            const char *val = bson_iter_utf8( iter,&len );
+            if ( ( ctx->flags & DECODE_VALIDATE ) && !utf8_valid( val,len ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_UTF8,"invalid utf-8 string of %s",
+                    bson_iter_key( iter ) );
+                return -1;
+            }
+            lua_pushlstring( L,val,len );
+        }break;
+        case BSON_TYPE_OID       :
+        {
+            if ( ctx->flags & DECODE_TYPED )
+            {
+                value_new( L,bson_iter_value( iter ) );
+                break;
+            }
+
+            const bson_oid_t *oid = bson_iter_oid ( iter );
+
+            char str[25];  /* bson api make it 25 */
+            bson_oid_to_string( oid, str );
+            lua_pushstring( L,str );
+        }break;
+        case BSON_TYPE_BOOL      :
+        {
+            bool val = bson_iter_bool( iter );
+            lua_pushboolean( L,val );
+        }break;
+        case BSON_TYPE_NULL      :
+        {
+            /* NULL == nil in lua */
+            lua_pushnil( L );
+        }break;
+        case BSON_TYPE_INT32     :
+        {
+            int val = bson_iter_int32( iter );
+            lua_pushinteger( L,val );
+        }break;
+        case BSON_TYPE_DATE_TIME :
+        {
+            /* A 64-bit integer containing the number of milliseconds since
+             * the UNIX epoch
+             */
+            if ( ctx->flags & DECODE_TYPED )
+            {
+                value_new( L,bson_iter_value( iter ) );
+                break;
+            }
+
+            int64_t val = bson_iter_date_time( iter );
+            lua_pushinteger( L,val );
+        }break;
+        case BSON_TYPE_INT64     :
+        {
+            int64_t val = bson_iter_int64( iter );
+            lua_pushinteger( L,val );
+        }break;
+        default :
+        {
+            /* extended types,see value_types */
+            if ( !value_types[(uint8_t)bson_iter_type( iter )].name )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "unknow bson type:%d",bson_iter_type( iter ) );
+                return -1;
+            }
+            value_new( L,bson_iter_value( iter ) );
+        }break;
+    }
+
+    return 0;
+}
+
+/* drop everything appended to doc since it's length was len.doc must not
+ * have a child in progress
+ */
+static void bson_truncate( bson_t *doc,uint32_t len )
+{
+    uint8_t *data = (uint8_t *)bson_get_data( doc );
+    uint32_t len_le = BSON_UINT32_TO_LE( len );
+
+    doc->len = len;
+    memcpy( data,&len_le,sizeof(len_le) );
+    data[len - 1] = 0;
+}
+
+/* encode and decode walk nested tables/documents without recursion.every
+ * level is a frame in a explicit stack,frames are allocated in chunks at
+ * the first time a document reach the depth and kept across calls,so a
+ * frame never move while a child bson_t point to it's parent.busy is set
+ * while the stack is in use,a nested call(from a __gc metamethod run by a
+ * allocation) use a temporary stack
+ */
+#define DEFAULT_MAX_DEPTH 512
+#define FRAME_CHUNK       32 /* frames allocated a time */
+#define STACK_CHUNK       16 /* levels checked by lua_checkstack a time */
+
+struct frame_stack
+{
+    char **chunks;
+    int chunk_count;
+    int busy;
+};
+
+/* sorted key order of a table shape,which is the keys in lua_next order.
+ * tables built the same way have the same shape,so canonical encode sort
+ * them once
+ */
+#define SHAPE_CACHE_SIZE 64  /* power of 2 */
+#define SHAPE_MAX_KEYS   256 /* bigger tables are sorted every time */
+
+struct shape_slot
+{
+    uint32_t hash;
+    int count;
+    int *order;           /* index in lua_next order,by sorted order */
+};
+
+struct lbs_engine
+{
+    int max_depth;
+    struct frame_stack encode;
+    struct frame_stack decode;
+    struct shape_slot shapes[SHAPE_CACHE_SIZE];
+    struct batch_pool *pool; /* decode_batch workers,started at first use */
+};
+
+static void batch_pool_stop( struct batch_pool *pool );
+static void mem_engine_close( const struct lbs_engine *engine );
+
+static const char engine_key = 0; /* registry key of engine */
+
+/* engine of L,NULL if the library is not opened in L */
+static struct lbs_engine *engine_get( lua_State *L )
+{
+    struct lbs_engine *engine = NULL;
+    if ( LUA_TUSERDATA == lua_rawgetp( L,LUA_REGISTRYINDEX,&engine_key ) )
+    {
+        engine = (struct lbs_engine *)lua_touserdata( L,-1 );
+    }
+    lua_pop( L,1 );
+
+    return engine;
+}
+
+/* max_depth of L,for the walkers without a frame stack */
+static int engine_max_depth( lua_State *L )
+{
+    struct lbs_engine *engine = engine_get( L );
+
+    return engine ? engine->max_depth : DEFAULT_MAX_DEPTH;
+}
+
+/* frame at depth(start from 0),NULL if out of memory */
+static void *frame_at( struct frame_stack *stack,int depth,size_t size )
+{
+    int chunk = depth / FRAME_CHUNK;
+    if ( chunk >= stack->chunk_count )
+    {
+        int count = stack->chunk_count ? stack->chunk_count * 2 : 4;
+        while ( count <= chunk ) count *= 2;
+
+        char **chunks = (char **)realloc( stack->chunks,count * sizeof(char *) );
+        if ( !chunks ) return NULL;
+
+        memset( chunks + stack->chunk_count,0,
+            ( count - stack->chunk_count ) * sizeof(char *) );
+        stack->chunks = chunks;
+        stack->chunk_count = count;
+    }
+
+    if ( !stack->chunks[chunk] )
+    {
+        /* bson_t may be declared with 128 bytes alignment */
+        void *ptr = NULL;
+        if ( 0 != posix_memalign( &ptr,128,FRAME_CHUNK * size ) ) return NULL;
+
+        stack->chunks[chunk] = (char *)ptr;
+    }
+
+    return stack->chunks[chunk] + ( depth % FRAME_CHUNK ) * size;
+}
+
+static void frame_stack_free( struct frame_stack *stack )
+{
+    for ( int i = 0;i < stack->chunk_count;i ++ ) free( stack->chunks[i] );
+    free( stack->chunks );
+
+    stack->chunks = NULL;
+    stack->chunk_count = 0;
+}
+
+/* get the frame stack of L for one call,tmp is used if it's busy */
+static struct frame_stack *frame_stack_acquire( lua_State *L,
+    int decode,struct frame_stack *tmp,int *max_depth )
+{
+    memset( tmp,0,sizeof(struct frame_stack) );
+
+    struct frame_stack *stack = tmp;
+    struct lbs_engine *engine = engine_get( L );
+
+    *max_depth = DEFAULT_MAX_DEPTH;
+    if ( engine )
+    {
+        struct frame_stack *own = decode ? &engine->decode : &engine->encode;
+
+        *max_depth = engine->max_depth;
+        if ( !own->busy ) stack = own;
+    }
+
+    stack->busy = 1;
+    return stack;
+}
+
+static void frame_stack_release( struct frame_stack *stack,
+    struct frame_stack *tmp )
+{
+    stack->busy = 0;
+    if ( stack == tmp ) frame_stack_free( tmp );
+}
+
+#define LBS_ENGINE "lua_bson.engine"
+
+static int engine_gc( lua_State *L )
+{
+    struct lbs_engine *engine =
+        (struct lbs_engine *)luaL_checkudata( L,1,LBS_ENGINE );
+
+    frame_stack_free( &engine->encode );
+    frame_stack_free( &engine->decode );
+    for ( int i = 0;i < SHAPE_CACHE_SIZE;i ++ ) free( engine->shapes[i].order );
+    if ( engine->pool ) batch_pool_stop( engine->pool );
+    engine->pool = NULL;
+    mem_engine_close( engine );
+
+    return 0;
+}
+
+/* create the engine of L if not yet */
+static void engine_init( lua_State *L )
+{
+    if ( LUA_TUSERDATA == lua_rawgetp( L,LUA_REGISTRYINDEX,&engine_key ) )
+    {
+        lua_pop( L,1 );
+        return;
+    }
+    lua_pop( L,1 );
+
+    struct lbs_engine *engine =
+        (struct lbs_engine *)lua_newuserdata( L,sizeof(struct lbs_engine) );
+    memset( engine,0,sizeof(struct lbs_engine) );
+    engine->max_depth = DEFAULT_MAX_DEPTH;
+
+    luaL_setmetatable( L,LBS_ENGINE );
+    lua_rawsetp( L,LUA_REGISTRYINDEX,&engine_key );
+}
+
+/* old = max_depth( depth ),set the max nested depth of encode and decode.
+ * return the old one,depth is optional to just query it
+ */
+static int lbs_max_depth( lua_State *L )
+{
+    engine_init( L );
+    lua_rawgetp( L,LUA_REGISTRYINDEX,&engine_key );
+
+    struct lbs_engine *engine = (struct lbs_engine *)lua_touserdata( L,-1 );
+    lua_pushinteger( L,engine->max_depth );
+
+    if ( !lua_isnoneornil( L,1 ) )
+    {
+        lua_Integer depth = luaL_checkinteger( L,1 );
+        luaL_argcheck( L,depth > 0 && depth <= INT_MAX / 2,1,"invalid depth" );
+
+        engine->max_depth = (int)depth;
+    }
+
+    return 1;
+}
+
+/* tables seen by a encode call.slots is a open addressing hash of the
+ * table pointer,the value is index of entries plus 1,which is also the id
+ * of the table,in the order a decoder create tables.entries are removed
+ * in reverse order only,so a slot is just cleared without breaking the
+ * probe chain of the others
+ */
+#define REF_KEY "$lref" /* { $lref = id } is a reference */
+
+struct ref_entry
+{
+    const void *ptr;
+    int open;             /* the table is still being encoded */
+};
+
+struct ref_set
+{
+    int flags;            /* ENCODE_REFS,ENCODE_STRICT */
+    int count;
+    int cap;              /* size of entries */
+    uint32_t mask;        /* size of slots - 1 */
+    int *slots;
+    struct ref_entry *entries;
+};
+
+static inline uint32_t ref_hash( const void *ptr )
+{
+    uint64_t v = (uint64_t)(uintptr_t)ptr;
+    return (uint32_t)( ( v >> 4 ) * 0x9E3779B97F4A7C15ull >> 32 );
+}
+
+static void ref_set_init( struct ref_set *set,int flags )
+{
+    memset( set,0,sizeof(struct ref_set) );
+    set->flags = flags;
+}
+
+static void ref_set_free( struct ref_set *set )
+{
+    free( set->slots );
+    free( set->entries );
+    set->slots = NULL;
+    set->entries = NULL;
+}
+
+/* slot of ptr,or the empty slot it should be */
+static int *ref_slot( struct ref_set *set,const void *ptr )
+{
+    uint32_t i = ref_hash( ptr ) & set->mask;
+    while ( set->slots[i] && set->entries[set->slots[i] - 1].ptr != ptr )
+    {
+        i = ( i + 1 ) & set->mask;
+    }
+
+    return set->slots + i;
+}
+
+/* id of ptr,0 if not found */
+static int ref_find( struct ref_set *set,const void *ptr )
+{
+    return set->slots ? *ref_slot( set,ptr ) : 0;
+}
+
+/* add ptr as a open table,return it's id,-1 if out of memory */
+static int ref_add( struct ref_set *set,const void *ptr )
+{
+    if ( set->count >= set->cap )
+    {
+        int cap = set->cap ? set->cap * 2 : 32;
+        struct ref_entry *entries = (struct ref_entry *)
+            realloc( set->entries,cap * sizeof(struct ref_entry) );
+        if ( !entries ) return -1;
+
+        /* keep slots no more than half full */
+        int *slots = (int *)calloc( cap * 2,sizeof(int) );
+        if ( !slots )
+        {
+            set->entries = entries;
+            return -1;
+        }
+
+        free( set->slots );
+        set->slots = slots;
+        set->entries = entries;
+        set->cap = cap;
+        set->mask = (uint32_t)( cap * 2 - 1 );
+        for ( int i = 0;i < set->count;i ++ )
+        {
+            *ref_slot( set,entries[i].ptr ) = i + 1;
+        }
+    }
+
+    struct ref_entry *entry = set->entries + set->count;
+    entry->ptr  = ptr;
+    entry->open = 1;
+
+    *ref_slot( set,ptr ) = ++set->count;
+    return set->count;
+}
+
+/* remove the entries after the first count */
+static void ref_truncate( struct ref_set *set,int count )
+{
+    while ( set->count > count )
+    {
+        *ref_slot( set,set->entries[--set->count].ptr ) = 0;
+    }
+}
+
+/* keys of the tables in canonical encode.every frame walking sorted keys
+ * own a segment at the end,which is dropped when the frame done.order is
+ * the sorted index of keys in the segment,tmp is used by sort
+ */
+struct canon_key
+{
+    const char *str;      /* bson key,NULL if it's in buf */
+    int len;
+    int type;             /* lua type of the key */
+    int integer;          /* a number key is integer */
+    lua_Integer i;        /* integer or boolean key */
+    lua_Number n;
+    char buf[MAX_KEY_LENGTH];
+};
+
+struct canon_keys
+{
+    int count;
+    int cap;
+    struct canon_key *keys;
+    int *order;
+    int *tmp;
+    struct shape_slot *shapes; /* NULL if no engine */
+};
+
+static void canon_keys_free( struct canon_keys *canon )
+{
+    free( canon->keys );
+    free( canon->order );
+    free( canon->tmp );
+}
+
+static int canon_reserve( struct canon_keys *canon,int count )
+{
+    if ( count <= canon->cap ) return 0;
+
+    int cap = canon->cap ? canon->cap * 2 : 64;
+    while ( cap < count ) cap *= 2;
+
+    struct canon_key *keys = (struct canon_key *)
+        realloc( canon->keys,cap * sizeof(struct canon_key) );
+    if ( !keys ) return -1;
+    canon->keys = keys;
+
+    int *order = (int *)realloc( canon->order,cap * sizeof(int) );
+    if ( !order ) return -1;
+    canon->order = order;
+
+    int *tmp = (int *)realloc( canon->tmp,cap * sizeof(int) );
+    if ( !tmp ) return -1;
+    canon->tmp = tmp;
+
+    canon->cap = cap;
+    return 0;
+}
+
+static inline int canon_cmp( const struct canon_key *a,const struct canon_key *b )
+{
+    const char *ka = a->str ? a->str : a->buf;
+    const char *kb = b->str ? b->str : b->buf;
+
+    int cmp = memcmp( ka,kb,a->len < b->len ? a->len : b->len );
+    return cmp ? cmp : a->len - b->len;
+}
+
+/* bottom up merge sort of order[0,count) by key */
+static void canon_sort( const struct canon_key *keys,int *order,int *tmp,int count )
+{
+    for ( int width = 1;width < count;width *= 2 )
+    {
+        for ( int lo = 0;lo < count;lo += width * 2 )
+        {
+            int mid = lo + width < count ? lo + width : count;
+            int hi = lo + width * 2 < count ? lo + width * 2 : count;
+
+            int i = lo,j = mid,k = lo;
+            while ( i < mid && j < hi )
+            {
+                tmp[k++] = canon_cmp( keys + order[j],keys + order[i] ) < 0 ?
+                    order[j++] : order[i++];
+            }
+            while ( i < mid ) tmp[k++] = order[i++];
+            while ( j < hi ) tmp[k++] = order[j++];
+        }
+        memcpy( order,tmp,count * sizeof(int) );
+    }
+}
+
+/* order is strictly increasing,so it's a sorted permutation */
+static int canon_sorted( const struct canon_key *keys,const int *order,int count )
+{
+    for ( int i = 0;i < count;i ++ )
+    {
+        if ( order[i] < 0 || order[i] >= count ) return 0;
+        if ( i > 0 && canon_cmp( keys + order[i - 1],keys + order[i] ) >= 0 )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* sort the keys in [first,first + count),try the shape cache first */
+static void canon_order( struct canon_keys *canon,int first,int count )
+{
+    const struct canon_key *keys = canon->keys + first;
+    int *order = canon->order + first;
+
+    uint32_t hash = 2166136261u;
+    for ( int i = 0;i < count;i ++ )
+    {
+        const struct canon_key *key = keys + i;
+        hash = ( hash ^ key_hash( key->str ? key->str : key->buf,key->len ) )
+            * 16777619u;
+    }
+
+    struct shape_slot *slot = NULL;
+    if ( canon->shapes && count <= SHAPE_MAX_KEYS )
+    {
+        slot = canon->shapes + ( hash & ( SHAPE_CACHE_SIZE - 1 ) );
+        if ( slot->order && slot->hash == hash && slot->count == count )
+        {
+            memcpy( order,slot->order,count * sizeof(int) );
+            if ( canon_sorted( keys,order,count ) ) return;
+        }
+    }
+
+    for ( int i = 0;i < count;i ++ ) order[i] = i;
+    canon_sort( keys,order,canon->tmp + first,count );
+
+    if ( !slot ) return;
+
+    int *cached = (int *)realloc( slot->order,( count ? count : 1 ) * sizeof(int) );
+    if ( !cached ) return;
+
+    memcpy( cached,order,count * sizeof(int) );
+    slot->order = cached;
+    slot->hash  = hash;
+    slot->count = count;
+}
+
+/* xxhash64 of the encoded buffer,so a canonical document can be used as a
+ * key of dedup cache without hashing it again in lua
+ */
+#define XXH_PRIME1 11400714785074694791ull
+#define XXH_PRIME2 14029467366897019727ull
+#define XXH_PRIME3 1609587929392839161ull
+#define XXH_PRIME4 9650029242287828579ull
+#define XXH_PRIME5 2870177450012600261ull
+
+static inline uint64_t xxh_rotl( uint64_t v,int r )
+{
+    return ( v << r ) | ( v >> ( 64 - r ) );
+}
+
+static inline uint64_t xxh_read64( const uint8_t *p )
+{
+    uint64_t v;
+    memcpy( &v,p,sizeof(v) );
+    return v;
+}
+
+static inline uint32_t xxh_read32( const uint8_t *p )
+{
+    uint32_t v;
+    memcpy( &v,p,sizeof(v) );
+    return v;
+}
+
+static inline uint64_t xxh_round( uint64_t acc,uint64_t input )
+{
+    acc += input * XXH_PRIME2;
+    return xxh_rotl( acc,31 ) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge( uint64_t acc,uint64_t val )
+{
+    acc ^= xxh_round( 0,val );
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static uint64_t xxh64( const uint8_t *p,size_t len,uint64_t seed )
+{
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if ( len >= 32 )
+    {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        uint64_t v2 = seed + XXH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME1;
+        do
+        {
+            v1 = xxh_round( v1,xxh_read64( p ) );
+            v2 = xxh_round( v2,xxh_read64( p + 8 ) );
+            v3 = xxh_round( v3,xxh_read64( p + 16 ) );
+            v4 = xxh_round( v4,xxh_read64( p + 24 ) );
+            p += 32;
+        } while ( p + 32 <= end );
+
+        h = xxh_rotl( v1,1 ) + xxh_rotl( v2,7 )
+            + xxh_rotl( v3,12 ) + xxh_rotl( v4,18 );
+        h = xxh_merge( h,v1 );
+        h = xxh_merge( h,v2 );
+        h = xxh_merge( h,v3 );
+        h = xxh_merge( h,v4 );
+    }
+    else
+    {
+        h = seed + XXH_PRIME5;
+    }
+
+    h += (uint64_t)len;
+    for ( ;p + 8 <= end;p += 8 )
+    {
+        h ^= xxh_round( 0,xxh_read64( p ) );
+        h = xxh_rotl( h,27 ) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if ( p + 4 <= end )
+    {
+        h ^= (uint64_t)xxh_read32( p ) * XXH_PRIME1;
+        h = xxh_rotl( h,23 ) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for ( ;p < end;p ++ )
+    {
+        h ^= (*p) * XXH_PRIME5;
+        h = xxh_rotl( h,11 ) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* how a encode frame walk it's table */
+enum
+{
+    WALK_SEQUENCE = 0, /* lua_next,expect key 1,2,3... */
+    WALK_OBJECT   = 1, /* lua_next,keys converted to string */
+    WALK_FORCE    = 2, /* lua_next,keys are the running index */
+    WALK_SPARSE   = 3, /* lua_rawgeti 1..max_index,missing ones are null */
+    WALK_SORTED   = 4  /* collected keys in sorted order,ENCODE_CANONICAL */
+};
+
+struct encode_frame
+{
+    bson_t child;         /* doc of a sub table */
+    bson_t *doc;
+    bson_t *parent;       /* NULL if doc is the caller's */
+    uint32_t type_offset; /* type byte of doc in parent */
+    uint32_t start;       /* length of doc before walk */
+    int index;            /* stack index of the table */
+    int flag;             /* __array */
+    int walk;             /* WALK_* */
+    int array;
+    int max_index;
+    lua_Integer next;     /* next key of sequence,or next array index */
+    int ref;              /* id in ctx->refs */
+    int key_first;        /* segment in ctx->canon of WALK_SORTED */
+    int key_count;
+};
+
+/* convert the key at stack top - 1 into a bson key,buffer is used by a
+ * number key
+ */
+static const char *table_key( lua_State *L,
+    char *buffer,int *key_len,struct encode_ctx *ctx )
+{
+    switch ( lua_type( L,-2 ) )
+    {
+        case LUA_TBOOLEAN :
+        {
+            int val = lua_toboolean( L,-2 );
+            *key_len = val ? 4 : 5;
+            return val ? "true" : "false";
+        }break;
+        case LUA_TNUMBER  :
+        {
+            /* integral float key is converted to integer by lua */
+            if ( lua_isinteger( L,-2 ) )
+                *key_len = fast_itoa( buffer,lua_tointeger( L,-2 ) );
+            else
+                *key_len = snprintf( buffer,MAX_KEY_LENGTH,
+                    LUA_NUMBER_FMT,lua_tonumber( L,-2 ) );
+            return buffer;
+        }break;
+        case LUA_TSTRING :
+        {
+            size_t len = 0;
+            const char *key = lua_tolstring( L,-2,&len );
+            if ( len > MAX_KEY_LENGTH - 1 )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_SIZE,
+                    "lua table string key too long\n" );
+                return NULL;
+            }
+
+            *key_len = (int)len;
+            return key;
+        }break;
+        default :
+        {
+            ERROR_LOG( ctx->ec,LBS_ERROR_TYPE,
+                "can not convert %s to bson key\n",
+                lua_typename( L,lua_type( L,-2 ) ) );
+        }break;
+    }
+
+    return NULL;
+}
+
+/* collect the keys of the table at index into a new segment and sort them.
+ * return the first key of the segment,-1 on error
+ */
+static int canon_collect( lua_State *L,
+    int index,int *count,struct encode_ctx *ctx )
+{
+    struct canon_keys *canon = ctx->canon;
+    int first = canon->count;
+
+    lua_pushnil( L );
+    while ( lua_next( L,index ) != 0 )
+    {
+        if ( canon_reserve( canon,canon->count + 1 ) < 0 )
+        {
+            lua_pop( L,2 );
+            ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+            return -1;
+        }
+
+        struct canon_key *key = canon->keys + canon->count;
+        const char *str = table_key( L,key->buf,&key->len,ctx );
+        if ( !str )
+        {
+            lua_pop( L,2 );
+            return -1;
+        }
+
+        key->str  = str == key->buf ? NULL : str;
+        key->type = lua_type( L,-2 );
+        key->integer = LUA_TNUMBER == key->type && lua_isinteger( L,-2 );
+        if ( LUA_TBOOLEAN == key->type )
+            key->i = lua_toboolean( L,-2 );
+        else if ( key->integer )
+            key->i = lua_tointeger( L,-2 );
+        else if ( LUA_TNUMBER == key->type )
+            key->n = lua_tonumber( L,-2 );
+
+        ++canon->count;
+        lua_pop( L,1 );
+    }
+
+    *count = canon->count - first;
+    canon_order( canon,first,*count );
+
+    return first;
+}
+
+/* push the lua key of a collected key */
+static void canon_push_key( lua_State *L,const struct canon_key *key )
+{
+    switch ( key->type )
+    {
+        case LUA_TBOOLEAN :
+        {
+            lua_pushboolean( L,(int)key->i );
+        }break;
+        case LUA_TNUMBER :
+        {
+            if ( key->integer )
+                lua_pushinteger( L,key->i );
+            else
+                lua_pushnumber( L,key->n );
+        }break;
+        default :
+        {
+            lua_pushlstring( L,key->str,key->len );
+        }break;
+    }
+}
+
+/* begin a frame for the table at index.with a key,the table is written
+ * straight into doc as a sub document,it always begin as a array and the
+ * type byte is fixed up if it turn out to be a object
+ */
+static struct encode_frame *encode_frame_push( lua_State *L,
+    struct frame_stack *stack,int top,int max_depth,bson_t *doc,
+    const char *key,int key_len,int index,struct encode_ctx *ctx )
+{
+    if ( ctx->depth >= max_depth )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,
+            "table too deep,max depth is %d",max_depth );
+        return NULL;
+    }
+
+    /* table and key of every frame,and 2 more to scan keys by is_array */
+    if ( 0 == top % STACK_CHUNK && !lua_checkstack( L,STACK_CHUNK * 2 + 4 ) )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"stack overflow" );
+        return NULL;
+    }
+
+    struct encode_frame *frame = (struct encode_frame *)
+        frame_at( stack,top,sizeof(struct encode_frame) );
+    if ( !frame )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+        return NULL;
+    }
+
+    frame->index = index;
+    frame->flag  = array_metafield( L,index,ctx );
+    frame->walk  = ARRAY_OBJECT == frame->flag ? WALK_OBJECT : WALK_SEQUENCE;
+    if ( WALK_OBJECT == frame->walk && ctx->canon )
+    {
+        frame->key_first = canon_collect( L,index,&frame->key_count,ctx );
+        if ( frame->key_first < 0 ) return NULL;
+
+        frame->walk = WALK_SORTED;
+    }
+
+    frame->ref = 0;
+    if ( ctx->refs
+        && ( frame->ref = ref_add( ctx->refs,lua_topointer( L,index ) ) ) < 0 )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+        return NULL;
+    }
+
+    if ( ++ctx->depth > ctx->max_depth ) ctx->max_depth = ctx->depth;
+
+    if ( key )
+    {
+        frame->parent = doc;
+        frame->type_offset = doc->len - 1;
+        frame->doc = &frame->child;
+        bson_append_array_begin( doc,key,key_len,&frame->child );
+    }
+    else
+    {
+        frame->parent = NULL;
+        frame->doc = doc;
+    }
+
+    frame->start = frame->doc->len;
+    frame->array = 0;
+    frame->max_index = -1;
+    if ( WALK_SORTED == frame->walk )
+    {
+        frame->next = 0;
+    }
+    else
+    {
+        frame->next = 1;
+        lua_pushnil( L );
+    }
+
+    return frame;
+}
+
+/* most arrays are built by table constructor or appended in order,lua_next
+ * give their key 1,2,3... in order.a table is encoded as such a sequence in
+ * one pass first.when a key break the sequence,drop everything appended and
+ * walk the table again.object is 1 if a key which never be a array index
+ * found
+ */
+static int encode_frame_rewalk( lua_State *L,
+    struct encode_frame *frame,int object,struct encode_ctx *ctx )
+{
+    bson_truncate( frame->doc,frame->start );
+
+    /* tables in the dropped part are encoded again */
+    if ( ctx->refs ) ref_truncate( ctx->refs,frame->ref );
+
+    frame->next = 1;
+    if ( object && ARRAY_UNSET == frame->flag )
+    {
+        frame->array = 0;
+        frame->walk  = WALK_OBJECT;
+    }
+    else
+    {
+        /* a sparse array,or integer keys not in order,or __array is set
+         * and the table is not a sequence.scan all keys to decide
+         */
+        is_array( L,frame->index,frame->flag,&frame->array,&frame->max_index );
+        if ( !frame->array )
+            frame->walk = WALK_OBJECT;
+        else
+            frame->walk = frame->max_index > 0 ? WALK_SPARSE : WALK_FORCE;
+    }
+
+    if ( WALK_SPARSE == frame->walk ) return 0;
+
+    /* keys of a object or a forced array are in lua_next order */
+    if ( ctx->canon )
+    {
+        frame->key_first = canon_collect( L,frame->index,&frame->key_count,ctx );
+        if ( frame->key_first < 0 ) return -1;
+
+        frame->next = 0;
+        frame->walk = WALK_SORTED;
+        return 0;
+    }
+
+    lua_pushnil( L );
+    return 0;
+}
+
+/* write the dotted path of the frames in progress and key into buffer */
+static void encode_path( struct frame_stack *stack,int top,
+    const char *key,int key_len,char *buffer,size_t size )
+{
+    size_t len = 0;
+    buffer[0] = 0;
+    for ( int i = 0;i < top;i ++ )
+    {
+        const struct encode_frame *frame = (const struct encode_frame *)
+            frame_at( stack,i,sizeof(struct encode_frame) );
+        if ( !frame->parent ) continue;
+
+        /* the key is in parent,just after the type byte */
+        const char *name = (const char *)
+            bson_get_data( frame->parent ) + frame->type_offset + 1;
+        len += snprintf( buffer + len,size - len,"%s.",name );
+        if ( len >= size ) return;
+    }
+
+    snprintf( buffer + len,size - len,"%.*s",key_len,key );
+}
+
+/* the table at stack top was seen by this call.write a reference to it
+ * and return 1 if ENCODE_REFS set,a error if it contain itself and
+ * ENCODE_STRICT set,otherwise return 0 to encode it again
+ */
+static int encode_ref( lua_State *L,struct frame_stack *stack,int top,
+    bson_t *doc,const char *key,int key_len,struct encode_ctx *ctx )
+{
+    struct ref_set *set = ctx->refs;
+    int id = ref_find( set,lua_topointer( L,-1 ) );
+    if ( !id ) return 0;
+
+    if ( set->entries[id - 1].open && ( set->flags & ENCODE_STRICT ) )
+    {
+        char path[LBS_MAX_ERROR_MSG / 2];
+        encode_path( stack,top,key,key_len,path,sizeof(path) );
+        ERROR_LOG( ctx->ec,LBS_ERROR_CYCLE,"table cycle at %s",path );
+        return -1;
+    }
+
+    if ( !( set->flags & ENCODE_REFS ) ) return 0;
+
+    bson_t child;
+    bson_append_document_begin( doc,key,key_len,&child );
+    bson_append_int32( &child,REF_KEY,-1,id );
+    bson_append_document_end( doc,&child );
+
+    return 1;
+}
+
+/* encode the lua table at index.key is NULL to encode it's fields into doc,
+ * otherwise it's appended to doc as a sub document.*array is set to 1 if
+ * the table is encoded as a array
+ */
+static int table_encode( lua_State *L,bson_t *doc,const char *key,
+    int key_len,int index,int *array,struct encode_ctx *ctx )
+{
+    int max_depth = 0;
+    struct frame_stack tmp;
+    struct frame_stack *stack = frame_stack_acquire( L,0,&tmp,&max_depth );
+
+    int base = lua_gettop( L );
+    if ( index < 0 ) index = base + index + 1;
+
+    int top = 0;
+    struct encode_frame *frame = encode_frame_push(
+        L,stack,top,max_depth,doc,key,key_len,index,ctx );
+    if ( !frame ) goto error;
+
+    ++top;
+    for ( ;; )
+    {
+        char buffer[MAX_KEY_LENGTH];
+        const char *pkey = NULL;
+        int pkey_len = 0;
+
+        int has = 0;
+        if ( WALK_SPARSE == frame->walk )
+        {
+            if ( frame->next <= frame->max_index )
+            {
+                has = 1;
+                lua_rawgeti( L,frame->index,frame->next );
+            }
+        }
+        else if ( WALK_SORTED == frame->walk )
+        {
+            if ( frame->next < frame->key_count )
+            {
+                has = 1;
+                canon_push_key( L,ctx->canon->keys + frame->key_first
+                    + ctx->canon->order[frame->key_first + frame->next] );
+                lua_rawget( L,frame->index );
+            }
+        }
+        else
+        {
+            has = lua_next( L,frame->index );
+        }
+
+        if ( !has ) /* end of the table */
+        {
+            if ( WALK_SEQUENCE == frame->walk )
+            {
+                /* a empty table without __array is a object */
+                frame->array = frame->next > 1 || ARRAY_FORCE == frame->flag;
+            }
+
+            if ( frame->parent )
+            {
+                if ( !frame->array )
+                {
+                    uint8_t *data = (uint8_t *)bson_get_data( frame->parent );
+                    data[frame->type_offset] = BSON_TYPE_DOCUMENT;
+                }
+                bson_append_array_end( frame->parent,&frame->child );
+            }
+
+            /* drop the keys segment,it's always the last one */
+            if ( WALK_SORTED == frame->walk )
+            {
+                ctx->canon->count = frame->key_first;
+            }
+
+            /* only the tables in progress are needed to find a cycle */
+            if ( ctx->refs )
+            {
+                if ( ctx->refs->flags & ENCODE_REFS )
+                    ctx->refs->entries[frame->ref - 1].open = 0;
+                else
+                    ref_truncate( ctx->refs,frame->ref - 1 );
+            }
+
+            --ctx->depth;
+            if ( 1 == top )
+            {
+                if ( array ) *array = frame->array;
+                break;
+            }
+
+            lua_pop( L,1 ); /* the table,value of parent's key */
+            frame = (struct encode_frame *)
+                frame_at( stack,--top - 1,sizeof(struct encode_frame) );
+            continue;
+        }
+
+        switch ( frame->walk )
+        {
+            case WALK_SEQUENCE :
+            {
+                if ( !lua_isinteger( L,-2 )
+                    || lua_tointeger( L,-2 ) != frame->next )
+                {
+                    int object = 0;
+                    if ( lua_type( L,-2 ) != LUA_TNUMBER )
+                    {
+                        object = 1;
+                    }
+                    else
+                    {
+                        double val = lua_tonumber( L,-2 );
+                        object = floor(val) != val
+                            || val < 1 || val > MAX_ARRAY_INDEX;
+                    }
+
+                    lua_pop( L,2 );
+                    if ( encode_frame_rewalk( L,frame,object,ctx ) < 0 )
+                    {
+                        goto error;
+                    }
+                    continue;
+                }
+            } /* fall through */
+            case WALK_FORCE  :
+            case WALK_SPARSE :
+            {
+                pkey = index_key( (int)( frame->next - 1 ),buffer,&pkey_len );
+                ++frame->next;
+            }break;
+            case WALK_OBJECT :
+            {
+                pkey = table_key( L,buffer,&pkey_len,ctx );
+                if ( !pkey ) goto error;
+            }break;
+            case WALK_SORTED :
+            {
+                /* a forced array use the running index as key */
+                if ( frame->array )
+                {
+                    pkey = index_key( (int)frame->next,buffer,&pkey_len );
+                }
+                else
+                {
+                    /* keys may move when a sub table collect it's keys,
+                     * copy the one in buf
+                     */
+                    const struct canon_key *ckey = ctx->canon->keys
+                        + frame->key_first
+                        + ctx->canon->order[frame->key_first + frame->next];
+                    pkey_len = ckey->len;
+                    if ( ckey->str )
+                    {
+                        pkey = ckey->str;
+                    }
+                    else
+                    {
+                        memcpy( buffer,ckey->buf,pkey_len + 1 );
+                        pkey = buffer;
+                    }
+                }
+                ++frame->next;
+            }break;
+        }
+
+        if ( LUA_TTABLE == lua_type( L,-1 ) )
+        {
+            int ref = ctx->refs ? encode_ref(
+                L,stack,top,frame->doc,pkey,pkey_len,ctx ) : 0;
+            if ( ref < 0 ) goto error;
+            if ( ref > 0 )
+            {
+                lua_pop( L,1 );
+                continue;
+            }
+
+            frame = encode_frame_push( L,stack,top,max_depth,
+                frame->doc,pkey,pkey_len,lua_gettop( L ),ctx );
+            if ( !frame ) goto error;
+
+            ++top;
+            continue;
+        }
+
+        if ( value_encode( L,frame->doc,pkey,pkey_len,lua_gettop( L ),ctx ) < 0 )
+        {
+            goto error;
+        }
+        lua_pop( L,1 );
+    }
+
+    lua_settop( L,base );
+    frame_stack_release( stack,&tmp );
+    return 0;
+
+error:
+    /* close sub documents in progress */
+    for ( int i = top - 1;i >= 0;i -- )
+    {
+        frame = (struct encode_frame *)
+            frame_at( stack,i,sizeof(struct encode_frame) );
+        if ( frame->parent ) bson_append_array_end( frame->parent,&frame->child );
+    }
+
+    lua_settop( L,base );
+    frame_stack_release( stack,&tmp );
+    return -1;
+}
+
+static int do_encode_into( lua_State *L,bson_t *doc,int index,
+    int *array,int flags,struct error_collector *ec,int *depth )
+{
+    struct encode_ctx ctx;
+    ENCODE_CTX_INIT( &ctx,ec );
+
+    struct ref_set refs;
+    if ( flags & ( ENCODE_REFS | ENCODE_STRICT ) )
+    {
+        ref_set_init( &refs,flags );
+        ctx.refs = &refs;
+    }
+
+    struct canon_keys canon;
+    if ( flags & ENCODE_CANONICAL )
+    {
+        struct lbs_engine *engine = engine_get( L );
+
+        memset( &canon,0,sizeof(canon) );
+        canon.shapes = engine ? engine->shapes : NULL;
+        ctx.canon = &canon;
+    }
+
+    int _is_array = 0;
+    int ret = table_encode( L,doc,NULL,0,index,&_is_array,&ctx );
+    if ( ctx.refs ) ref_set_free( ctx.refs );
+    if ( ctx.canon ) canon_keys_free( ctx.canon );
+
+    if ( ret < 0 ) return -1;
+
+    if ( array ) *array = _is_array;
+    if ( depth ) *depth = ctx.max_depth;
+
+    return 0;
+}
+
+static int encode_doc_into( lua_State *L,bson_t *doc,int index,
+    int *array,int flags,struct error_collector *ec )
+{
+    if ( !stats_enabled )
+    {
+        return do_encode_into( L,doc,index,array,flags,ec,NULL );
+    }
+
+    int depth = 0;
+    uint32_t len = doc->len;
+    double beg = stats_clock();
+
+    int ret = do_encode_into( L,doc,index,array,flags,ec,&depth );
+    stats_record( STATS_ENCODE,beg,ret,ec->kind,doc->len - len,depth );
+
+    return ret;
+}
+
+int lbs_do_encode_into( lua_State *L,
+    bson_t *doc,int index,int *array,struct error_collector *ec )
+{
+    return encode_doc_into( L,doc,index,array,0,ec );
+}
+
+static bson_t *encode_doc( lua_State *L,
+    int index,int *array,int flags,struct error_collector *ec )
+{
+    bson_t *doc = bson_new();
+    if ( encode_doc_into( L,doc,index,array,flags,ec ) < 0 )
+    {
+        bson_destroy( doc );
+        return NULL;
+    }
+
+    return doc;
+}
+
+bson_t *lbs_do_encode( lua_State *L,
+    int index,int *array,struct error_collector *ec )
+{
+    return encode_doc( L,index,array,0,ec );
+}
+
+
+/* decode a bson document into a lua table,push the table into stack
+ * https://docs.mongodb.org/v3.0/reference/bson-types/
+ * {
+ * BSON_TYPE_EOD           = 0x00,
+ * BSON_TYPE_DOUBLE        = 0x01,
+ * BSON_TYPE_UTF8          = 0x02,
+ * BSON_TYPE_DOCUMENT      = 0x03,
+ * BSON_TYPE_ARRAY         = 0x04,
+ * BSON_TYPE_BINARY        = 0x05,
+ * BSON_TYPE_UNDEFINED     = 0x06,
+ * BSON_TYPE_OID           = 0x07,
+ * BSON_TYPE_BOOL          = 0x08,
+ * BSON_TYPE_DATE_TIME     = 0x09,
+ * BSON_TYPE_NULL          = 0x0A,
+ * BSON_TYPE_REGEX         = 0x0B,
+ * BSON_TYPE_DBPOINTER     = 0x0C,
+ * BSON_TYPE_CODE          = 0x0D,
+ * BSON_TYPE_SYMBOL        = 0x0E,
+ * BSON_TYPE_CODEWSCOPE    = 0x0F,
+ * BSON_TYPE_INT32         = 0x10,
+ * BSON_TYPE_TIMESTAMP     = 0x11,
+ * BSON_TYPE_INT64         = 0x12,
+ * BSON_TYPE_MAXKEY        = 0x7F,
+ * BSON_TYPE_MINKEY        = 0xFF,
+ * } bson_type_t;
+*/
+/* lua index of a bson array key,lua array index start from 1.a canonical
+ * key is "0","1",...,just follow the running index.otherwise(sparse array
+ * or bson from other driver) parse the key
+ */
+static inline lua_Integer array_key_index(
+    const char *key,uint32_t key_len,int *index )
+{
+    int expect_len = 0;
+    char buffer[INTEGER_KEY_SIZE];
+    const char *expect = index_key( *index,buffer,&expect_len );
+    if ( (uint32_t)expect_len == key_len && 0 == memcmp( key,expect,key_len ) )
+    {
+        return ++(*index);
+    }
+
+    lua_Integer i = strtoll( key,NULL,10 );
+    if ( i >= 0 && i < MAX_ARRAY_INDEX ) *index = (int)i + 1;
+
+    return i + 1;
+}
+
+/* count elements of a document without moving the iterator */
+static inline int iter_count( const bson_iter_t *iter )
+{
+    int count = 0;
+    bson_iter_t cur = *iter;
+    while ( bson_iter_next( &cur ) ) ++count;
+
+    return count;
+}
+
+struct decode_frame
+{
+    bson_iter_t iter;
+    int array;        /* a bson array,or a document */
+    int index;        /* running index of array_key_index */
+    lua_Integer key;  /* lua index of the sub document in progress */
+};
+
+/* begin a frame for the document of iter,push a table for it */
+static struct decode_frame *decode_frame_push( lua_State *L,
+    struct frame_stack *stack,int top,int max_depth,
+    const bson_iter_t *iter,int array,struct decode_ctx *ctx )
+{
+    if ( ctx->depth >= max_depth )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,
+            "document too deep,max depth is %d",max_depth );
+        return NULL;
+    }
+
+    /* table and key of every frame,and value and a copy of key for key
+     * cache
+     */
+    if ( 0 == top % STACK_CHUNK && !lua_checkstack( L,STACK_CHUNK * 2 + 4 ) )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"bson_decode stack overflow" );
+        return NULL;
+    }
+
+    struct decode_frame *frame = (struct decode_frame *)
+        frame_at( stack,top,sizeof(struct decode_frame) );
+    if ( !frame )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+        return NULL;
+    }
+
+    if ( ++ctx->depth > ctx->max_depth ) ctx->max_depth = ctx->depth;
+
+    frame->iter  = *iter;
+    frame->array = array;
+    frame->index = 0;
+
+    /* presize the table,so it never rehash while filling */
+    int count = iter_count( iter );
+    if ( array )
+    {
+        lua_createtable( L,count,0 );
+    }
+    else
+    {
+        lua_createtable( L,0,count );
+    }
+
+    /* id of a table is the order it created,same as encoder */
+    if ( ctx->ref_index )
+    {
+        lua_pushvalue( L,-1 );
+        lua_rawseti( L,ctx->ref_index,++ctx->ref_count );
+    }
+
+    return frame;
+}
+
+/* id of a reference { $lref = id },0 if iter is not a reference */
+static int ref_marker( const bson_iter_t *iter )
+{
+    bson_iter_t child;
+    if ( !bson_iter_recurse( iter,&child ) || !bson_iter_next( &child )
+        || BSON_TYPE_INT32 != bson_iter_type( &child )
+        || 0 != strcmp( bson_iter_key( &child ),REF_KEY ) )
+    {
+        return 0;
+    }
+
+    int id = bson_iter_int32( &child );
+    return bson_iter_next( &child ) ? 0 : id;
+}
+
+/* decode the document of iter into a table and push it.sub documents are
+ * frames instead of recursion
+ */
+int bson_decode( lua_State*L,bson_iter_t *iter,
+    bson_type_t root_type,struct decode_ctx *ctx )
+{
+    int max_depth = 0;
+    struct frame_stack tmp;
+    struct frame_stack *stack = frame_stack_acquire( L,1,&tmp,&max_depth );
+
+    int base = lua_gettop( L );
+    int validate = ctx->flags & DECODE_VALIDATE;
+
+    int top = 0;
+    struct decode_frame *frame = decode_frame_push( L,stack,top,
+        max_depth,iter,BSON_TYPE_ARRAY == root_type,ctx );
+    if ( !frame ) goto error;
+
+    ++top;
+    for ( ;; )
+    {
+        bson_iter_t *it = &frame->iter;
+        if ( !bson_iter_next( it ) )
+        {
+            /* bson_iter_next stop at a corrupt element too */
+            if ( validate && it->err_off )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "corrupt bson document at %u",it->err_off );
+                goto error;
+            }
+
+            --ctx->depth;
+            if ( 1 == top ) break;
+
+            /* the table is the value of parent's element */
+            frame = (struct decode_frame *)
+                frame_at( stack,--top - 1,sizeof(struct decode_frame) );
+            if ( frame->array )
+                lua_rawseti( L,-2,frame->key );
+            else
+                lua_rawset( L,-3 );
+            continue;
+        }
+
+        const char *key  = bson_iter_key( it );
+        uint32_t key_len = bson_iter_key_len( it );
+        if ( frame->array )
+        {
+            frame->key = array_key_index( key,key_len,&frame->index );
+        }
+        else
+        {
+            if ( validate && !utf8_valid( key,key_len ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_UTF8,"invalid utf-8 key" );
+                goto error;
+            }
+            push_key( L,key,(int)key_len,ctx );
+        }
+
+        int ref = 0;
+        bson_type_t type = bson_iter_type( it );
+        if ( BSON_TYPE_DOCUMENT == type && ctx->ref_index
+            && ( ref = ref_marker( it ) ) > 0 )
+        {
+            if ( ref > ctx->ref_count )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,"invalid reference %d",ref );
+                goto error;
+            }
+            lua_rawgeti( L,ctx->ref_index,ref );
+        }
+        else if ( BSON_TYPE_DOCUMENT == type || BSON_TYPE_ARRAY == type )
+        {
+            bson_iter_t sub_iter;
+            if ( !bson_iter_recurse( it,&sub_iter ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "bson document iter recurse error" );
+                goto error;
+            }
+
+            frame = decode_frame_push( L,stack,top,max_depth,
+                &sub_iter,BSON_TYPE_ARRAY == type,ctx );
+            if ( !frame ) goto error;
+
+            ++top;
+            continue;
+        }
+        else if ( value_decode( L,it,ctx ) < 0 )
+        {
+            goto error;
+        }
+
+        /* the table is new and has no metatable,raw set is safe.lua_rawset
+         * is the same as lua_setfield,without interning key again
+         */
+        if ( frame->array )
+            lua_rawseti( L,-2,frame->key );
+        else
+            lua_rawset( L,-3 );
+    }
+
+    frame_stack_release( stack,&tmp );
+    return 0;
+
+error:
+    lua_settop( L,base );
+    frame_stack_release( stack,&tmp );
+    return -1;
+}
+
+static int do_decode( lua_State *L,const bson_t *doc,bson_type_t root_type,
+    int flags,struct error_collector *ec,int *depth )
+{
+    bson_iter_t iter;
+    if ( !bson_iter_init( &iter, doc ) )
+    {
+        ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson document" );
+
+       return -1;
+    }
+
+    struct decode_ctx ctx;
+    decode_ctx_init( L,&ctx,ec );
+    ctx.flags = flags;
+    if ( flags & DECODE_REFS )
+    {
+        lua_newtable( L );
+        ctx.ref_index = lua_gettop( L );
+    }
+
+    int ret = bson_decode( L,&iter,root_type,&ctx );
+    decode_ctx_done( L,&ctx );
+
+    if ( depth ) *depth = ctx.max_depth;
+    return ret;
+}
+
+static int decode_doc( lua_State *L,const bson_t *doc,
+    bson_type_t root_type,int flags,struct error_collector *ec )
+{
+    if ( !stats_enabled ) return do_decode( L,doc,root_type,flags,ec,NULL );
+
+    int depth = 0;
+    double beg = stats_clock();
+
+    int ret = do_decode( L,doc,root_type,flags,ec,&depth );
+    stats_record( STATS_DECODE,beg,ret,ec->kind,doc->len,depth );
+
+    return ret;
+}
+
+int lbs_do_decode( lua_State *L,
+    const bson_t *doc,bson_type_t root_type,struct error_collector *ec )
+{
+    return decode_doc( L,doc,root_type,0,ec );
+}
+
+/* encode varibale in lua stack start from index
+ * only number、table、boolean support.other type
+ * will raise a error
+ */
+static int do_encode_stack( lua_State *L,
+    bson_t *doc,int index,struct error_collector *ec,int *depth )
+{
+    assert( doc );
+    int top = lua_gettop( L );
+    if ( index > top )
+    {
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"nothing in stack to be encoded" );
+
+        return -1;
+    }
+
+    struct encode_ctx ctx;
+    ENCODE_CTX_INIT( &ctx,ec );
+
+    int key_index = (int)bson_count_keys( doc );
+    char buffer[INTEGER_KEY_SIZE];
+    for ( int i = index;i <= top;i ++ )
+    {
+        int key_len = 0;
+        const char *key = index_key( key_index++,buffer,&key_len );
+        if ( value_encode( L,doc,key,key_len,i,&ctx ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( depth ) *depth = ctx.max_depth;
+    return 0;
+}
+
+int lbs_do_encode_stack( lua_State *L,
+    bson_t *doc,int index,struct error_collector *ec )
+{
+    if ( !stats_enabled ) return do_encode_stack( L,doc,index,ec,NULL );
+
+    int depth = 0;
+    uint32_t len = doc->len;
+    double beg = stats_clock();
+
+    int ret = do_encode_stack( L,doc,index,ec,&depth );
+    stats_record( STATS_ENCODE_STACK,beg,ret,ec->kind,doc->len - len,depth );
+
+    return ret;
+}
+
+/* decode doc into lua stack
+ * return the number of variable push into stack
+ */
+static int do_decode_stack( lua_State *L,
+    const bson_t *doc,struct error_collector *ec,int *depth )
+{
+    bson_iter_t iter;
+    if ( !bson_iter_init( &iter, doc ) )
+    {
+        ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson document" );
+
+       return -1;
+    }
+
+    struct decode_ctx ctx;
+    decode_ctx_init( L,&ctx,ec );
+
+    int cnt = 0;
+    int top = lua_gettop( L );
+    while ( bson_iter_next( &iter ) )
+    {
+        if ( cnt + top > MAX_LUA_STACK || !lua_checkstack( L,1 ) )
+        {
+            lua_settop( L,top );
+            decode_ctx_done( L,&ctx );
+            ERROR_LOG( ec,LBS_ERROR_DEPTH,"lbs_decode_stack stack overflow" );
+            return -1;
+        }
+
+        if ( value_decode( L,&iter,&ctx ) < 0 )
+        {
+            lua_settop( L,top );
+            decode_ctx_done( L,&ctx );
+            return      -1;
+        }
+
+        ++cnt;
+    }
+
+    decode_ctx_done( L,&ctx );
+
+    if ( depth ) *depth = ctx.max_depth;
+    return cnt;
+}
+
+int lbs_do_decode_stack( lua_State *L,
+    const bson_t *doc,struct error_collector *ec )
+{
+    if ( !stats_enabled ) return do_decode_stack( L,doc,ec,NULL );
+
+    int depth = 0;
+    double beg = stats_clock();
+
+    int ret = do_decode_stack( L,doc,ec,&depth );
+    stats_record( STATS_DECODE_STACK,beg,ret,ec->kind,doc->len,depth );
+
+    return ret;
+}
+
+/* ENCODE_* flags from the option table at index */
+static int encode_opts( lua_State *L,int index )
+{
+    if ( lua_isnoneornil( L,index ) ) return 0;
+    luaL_checktype( L,index,LUA_TTABLE );
+
+    int flags = 0;
+    lua_getfield( L,index,"refs" );
+    if ( lua_toboolean( L,-1 ) ) flags |= ENCODE_REFS;
+    lua_pop( L,1 );
+
+    lua_getfield( L,index,"strict" );
+    if ( lua_toboolean( L,-1 ) ) flags |= ENCODE_STRICT;
+    lua_pop( L,1 );
+
+    lua_getfield( L,index,"canonical" );
+    if ( lua_toboolean( L,-1 ) ) flags |= ENCODE_CANONICAL;
+    lua_pop( L,1 );
+
+    return flags;
+}
+
+/* encode lua table into a bson buffer */
+static int lbs_encode( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    int success = 0;
+    int nothrow = lua_toboolean( L,2 );
+    int flags = encode_opts( L,3 );
+
+    if ( !lua_istable( L,1 ) )
+    {
+        ERROR_LOG( (&ec),LBS_ERROR_TYPE,"argument #1 table expected,got %s",
+                    lua_typename( L,lua_type(L,1) ) );
+        lua_pushnil( L ); /* fail,make sure buffer is nil */
+    }
+    else
+    {
+        bson_t *doc = encode_doc( L,1,NULL,flags,&ec );
+        if ( doc )
+        {
+            const char *buffer = (const char *)bson_get_data( doc );
+            lua_pushlstring( L,buffer,doc->len );
+
+            /* hash the buffer while it's still in cache */
+            if ( flags & ENCODE_CANONICAL )
+            {
+                lua_pushnil( L );
+                lua_pushinteger( L,(lua_Integer)xxh64(
+                    bson_get_data( doc ),doc->len,0 ) );
+            }
+
+            bson_destroy( doc );
+            success = 1;
+            return ( flags & ENCODE_CANONICAL ) ? 3 : 1;
+        }
+
+        lua_pushnil( L ); /* fail,make sure buffer is nil */
+    }
+
+    if ( !success )
+    {
+        if ( nothrow ) lua_pushstring( L,ec.what );
+        else luaL_error( L,ec.what );
+    }
+
+    return 2;
+}
+
+/* init doc over size bytes of data without copy.only the length header and
+ * the terminating zero are checked,elements are checked while iterating
+ */
+static int doc_init_static( const uint8_t *data,
+    size_t size,bson_t *doc,struct error_collector *ec )
+{
+    uint32_t len_le = 0;
+    if ( size < 5 )
+    {
+        ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson buffer" );
+        return -1;
+    }
+
+    memcpy( &len_le,data,sizeof(len_le) );
+    size_t len = BSON_UINT32_FROM_LE( len_le );
+    if ( len < 5 || len > size || data[len - 1] != 0
+        || !bson_init_static( doc,data,len ) )
+    {
+        ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson buffer" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* init doc over the lua string at index,without reader or copy.
+ * the optional offset(start from 0) and length at index + 2,index + 3
+ * locate a document embedded in a larger buffer,eg. a network packet
+ */
+static int buffer_doc_init( lua_State *L,
+    int index,bson_t *doc,struct error_collector *ec )
+{
+    if ( lua_type( L,index ) != LUA_TSTRING )
+    {
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"argument #%d string expected,got %s",
+            index,lua_typename( L,lua_type(L,index) ) );
+        return -1;
+    }
+
+    size_t sz = 0;
+    const char *buffer = lua_tolstring( L,index,&sz );
+
+    lua_Integer offset = luaL_optinteger( L,index + 2,0 );
+    if ( offset < 0 || (size_t)offset > sz )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"offset out of range" );
+        return -1;
+    }
+
+    size_t size = sz - (size_t)offset;
+    lua_Integer length = luaL_optinteger( L,index + 3,(lua_Integer)size );
+    if ( length < 0 || (size_t)length > size )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"length out of range" );
+        return -1;
+    }
+
+    return doc_init_static(
+        (const uint8_t *)buffer + offset,(size_t)length,doc,ec );
+}
+
+/* DECODE_* flags from the option table at index */
+static int decode_opts( lua_State *L,int index )
+{
+    if ( lua_isnoneornil( L,index ) ) return 0;
+    luaL_checktype( L,index,LUA_TTABLE );
+
+    int flags = 0;
+    lua_getfield( L,index,"validate" );
+    if ( lua_toboolean( L,-1 ) ) flags |= DECODE_VALIDATE;
+    lua_pop( L,1 );
+
+    lua_getfield( L,index,"typed" );
+    if ( lua_toboolean( L,-1 ) ) flags |= DECODE_TYPED;
+    lua_pop( L,1 );
+
+    lua_getfield( L,index,"refs" );
+    if ( lua_toboolean( L,-1 ) ) flags |= DECODE_REFS;
+    lua_pop( L,1 );
+
+    return flags;
+}
+
+/* decode a bson buffer into a lua table */
+static int lbs_decode( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    bson_t doc;
+    int nothrow = lua_toboolean( L,2 );
+    int flags = decode_opts( L,5 );
+
+    /* root type always be a document in bson */
+    if ( buffer_doc_init( L,1,&doc,&ec ) >= 0
+        && decode_doc( L,&doc,BSON_TYPE_DOCUMENT,flags,&ec ) >= 0 )
+    {
+        return 1;
+    }
+
+    if ( !nothrow )
+    {
+        luaL_error( L,ec.what );
+        return 0; /* in fact,it never return */
+    }
+
+    /* do not raise a error,return error message instead */
+    lua_pushnil( L ); /* fail,make sure buffer is nil */
+    lua_pushstring( L,ec.what );
+
+    return 2;
+}
+
+/* generate a objectid */
+static int lbs_object_id( lua_State *L )
+{
+    bson_oid_t oid;
+
+    bson_oid_init( &oid, NULL );
+
+    char str[25];
+
+    bson_oid_to_string( &oid, str );
+
+    lua_pushlstring( L,str, sizeof(str) );
+
+    return 1;
+}
+
+static int lbs_encode_stack( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    int nothrow = lua_toboolean( L,1 );
+    bson_t *doc = bson_new();
+    int err = lbs_do_encode_stack( L,doc,2,&ec );
+    if (  0 == err )
+    {
+        const char *buffer = (const char *)bson_get_data( doc );
+        lua_pushlstring( L,buffer,doc->len );
+    }
+
+    bson_destroy( doc );
+
+    if ( 0 == err ) return 1;
+
+    if ( !nothrow )
+    {
+        luaL_error( L,ec.what );
+        return 0; /* in fact,it never return */
+    }
+
+    /* do not raise a error,return error message instead */
+    lua_pushnil( L ); /* fail,make sure buffer is nil */
+    lua_pushstring( L,ec.what );
+
+    return 2;
+}
+
+static int lbs_decode_stack( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    bson_t doc;
+    int nothrow = lua_toboolean( L,2 );
+
+    if ( buffer_doc_init( L,1,&doc,&ec ) >= 0 )
+    {
+        int num = lbs_do_decode_stack( L,&doc,&ec );
+        if ( num > 0 ) return num;
+    }
+
+    if ( !nothrow )
+    {
+        luaL_error( L,ec.what );
+        return 0; /* in fact,it never return */
+    }
+
+    /* do not raise a error,return error message instead */
+    lua_pushnil( L ); /* fail,make sure buffer is nil */
+    lua_pushstring( L,ec.what );
+
+    return 2;
+}
+
+/* ===========================STREAM DECODE================================= */
+
+/* a reader iterate concatenated documents in a memory buffer,a file
+ * descriptor,a lua file handle or a mmap'd file.only one document is kept
+ * in memory at a time(fd and file handle),so a large dump never need to be
+ * loaded into a lua string
+ */
+#define LBS_READER "lua_bson.reader"
+
+struct lbs_reader
+{
+    bson_reader_t *reader;
+    void *map;       /* mmap'd file,if any */
+    size_t map_size;
+};
+
+static void reader_close( struct lbs_reader *reader )
+{
+    if ( reader->reader )
+    {
+        bson_reader_destroy( reader->reader );
+        reader->reader = NULL;
+    }
+    if ( reader->map )
+    {
+        munmap( reader->map,reader->map_size );
+        reader->map = NULL;
+    }
+}
+
+/* bson_reader_read_func_t for a lua file handle */
+static ssize_t reader_read_file( void *handle,void *buf,size_t count )
+{
+    luaL_Stream *stream = (luaL_Stream *)handle;
+
+    /* file closed by lua code while reading */
+    if ( !stream->closef ) return -1;
+
+    size_t n = fread( buf,1,count,stream->f );
+    if ( 0 == n && ferror( stream->f ) ) return -1;
+
+    return (ssize_t)n;
+}
+
+/* the lua file handle is closed by lua,nothing to do */
+static void reader_destroy_file( void *handle )
+{
+    (void)handle;
+}
+
+static int reader_mmap( struct lbs_reader *reader,const char *path )
+{
+    static const uint8_t empty[1] = { 0 };
+
+    int fd = open( path,O_RDONLY );
+    if ( fd < 0 ) return -1;
+
+    struct stat st;
+    if ( fstat( fd,&st ) < 0 )
+    {
+        close( fd );
+        return -1;
+    }
+
+    /* mmap a empty file is a error */
+    if ( st.st_size > 0 )
+    {
+        void *map = mmap( NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0 );
+        if ( MAP_FAILED == map )
+        {
+            close( fd );
+            return -1;
+        }
+
+        madvise( map,st.st_size,MADV_SEQUENTIAL );
+        reader->map = map;
+        reader->map_size = st.st_size;
+    }
+    close( fd );
+
+    reader->reader = bson_reader_new_from_data(
+        reader->map ? (const uint8_t *)reader->map : empty,reader->map_size );
+
+    return 0;
+}
+
+/* create a reader userdata over the source at index and push it.
+ * source is a string buffer,a file descriptor,a lua file handle,or a file
+ * path if the mode at index + 1 is "mmap"
+ */
+static struct lbs_reader *reader_new( lua_State *L,int index )
+{
+    const char *mode = luaL_optstring( L,index + 1,NULL );
+    luaL_argcheck( L,!mode || 0 == strcmp( mode,"mmap" ),
+        index + 1,"invalid mode" );
+
+    struct lbs_reader *reader = (struct lbs_reader *)
+        lua_newuserdata( L,sizeof(struct lbs_reader) );
+    memset( reader,0,sizeof(struct lbs_reader) );
+    luaL_setmetatable( L,LBS_READER );
+    MEM_HOLD();
+
+    if ( mode )
+    {
+        const char *path = luaL_checkstring( L,index );
+        if ( reader_mmap( reader,path ) < 0 )
+        {
+            luaL_error( L,"can not map %s:%s",path,strerror( errno ) );
+        }
+
+        return reader;
+    }
+
+    switch ( lua_type( L,index ) )
+    {
+        case LUA_TSTRING :
+        {
+            size_t sz = 0;
+            const char *buffer = lua_tolstring( L,index,&sz );
+            reader->reader =
+                bson_reader_new_from_data( (const uint8_t *)buffer,sz );
+        }break;
+        case LUA_TNUMBER :
+        {
+            lua_Integer fd = luaL_checkinteger( L,index );
+            luaL_argcheck( L,fd >= 0 && fd <= INT_MAX,index,"invalid fd" );
+
+            /* the fd is owned by caller,do not close it */
+            reader->reader = bson_reader_new_from_fd( (int)fd,false );
+        }break;
+        default :
+        {
+            luaL_Stream *stream =
+                (luaL_Stream *)luaL_checkudata( L,index,LUA_FILEHANDLE );
+            luaL_argcheck( L,stream->closef,index,"attempt to use a closed file" );
+
+            reader->reader = bson_reader_new_from_handle(
+                stream,reader_read_file,reader_destroy_file );
+        }break;
+    }
+
+    /* keep the string buffer or file handle alive */
+    lua_pushvalue( L,index );
+    lua_setuservalue( L,-2 );
+
+    return reader;
+}
+
+/* read next document and push it as a lua table,return 0 at the end */
+static int reader_read( lua_State *L,struct lbs_reader *reader )
+{
+    if ( !reader->reader ) return 0;
+
+    bool eof = false;
+    const bson_t *doc = bson_reader_read( reader->reader,&eof );
+    if ( !doc )
+    {
+        lua_Integer offset = (lua_Integer)bson_reader_tell( reader->reader );
+        reader_close( reader );
+
+        if ( eof ) return 0;
+        return luaL_error( L,"invalid bson stream at offset %I",offset );
+    }
+
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    if ( lbs_do_decode( L,doc,BSON_TYPE_DOCUMENT,&ec ) < 0 )
+    {
+        reader_close( reader );
+        return luaL_error( L,"%s",ec.what );
+    }
+
+    return 1;
+}
+
+static int reader_next( lua_State *L )
+{
+    struct lbs_reader *reader =
+        (struct lbs_reader *)luaL_checkudata( L,1,LBS_READER );
+
+    return reader_read( L,reader );
+}
+
+static int reader_gc( lua_State *L )
+{
+    struct lbs_reader *reader =
+        (struct lbs_reader *)luaL_checkudata( L,1,LBS_READER );
+
+    reader_close( reader );
+    MEM_UNHOLD();
+    return 0;
+}
+
+/* for doc in decode_iter( source,mode ) do ... end */
+static int lbs_decode_iter( lua_State *L )
+{
+    lua_pushcfunction( L,reader_next );
+    reader_new( L,1 );
+
+    return 2;
+}
+
+/* decode every document in source into a array */
+static int lbs_decode_all( lua_State *L )
+{
+    struct lbs_reader *reader = reader_new( L,1 );
+
+    lua_newtable( L );
+    for ( lua_Integer i = 1;reader_read( L,reader ) > 0;i ++ )
+    {
+        lua_rawseti( L,-2,i );
+    }
+
+    return 1;
+}
+
+static const luaL_Reg reader_lib[] =
+{
+    {"__gc", reader_gc},
+    {NULL, NULL}
+};
+
+/* ============================LAZY DECODE================================== */
+
+/* a lazy proxy decode nothing until a field is indexed.the field is found
+ * by iterating the raw bytes,a sub document become another proxy over the
+ * same buffer.decoded values and sub proxies are cached in uservalue,so
+ * each field is decoded only once.the proxy is read only
+ */
+#define LBS_LAZY "lua_bson.lazy"
+
+/* slots in uservalue table */
+#define LAZY_SOURCE 1 /* the lua string hold the bytes */
+#define LAZY_CACHE  2 /* decoded fields */
+
+struct lbs_lazy
+{
+    const uint8_t *data; /* the document bytes,inside LAZY_SOURCE */
+    uint32_t len;
+    int array;           /* a bson array or document */
+    int count;           /* number of elements,-1 if not counted yet */
+};
+
+/* create a proxy over data and push it.source is the index of the lua string
+ * which hold data
+ */
+static struct lbs_lazy *lazy_new( lua_State *L,
+    const uint8_t *data,uint32_t len,int array,int source )
+{
+    source = lua_absindex( L,source );
+
+    struct lbs_lazy *lazy = (struct lbs_lazy *)
+        lua_newuserdata( L,sizeof(struct lbs_lazy) );
+    lazy->data  = data;
+    lazy->len   = len;
+    lazy->array = array;
+    lazy->count = -1;
+    luaL_setmetatable( L,LBS_LAZY );
+
+    lua_createtable( L,2,0 );
+    lua_pushvalue( L,source );
+    lua_rawseti( L,-2,LAZY_SOURCE );
+    lua_setuservalue( L,-2 );
+
+    return lazy;
+}
+
+/* push the value iter point to.a sub document or array become a proxy
+ * sharing the source of the proxy at index
+ */
+static void lazy_push_value( lua_State *L,int index,bson_iter_t *iter )
+{
+    bson_type_t type = bson_iter_type( iter );
+    if ( BSON_TYPE_DOCUMENT == type || BSON_TYPE_ARRAY == type )
+    {
+        uint32_t len = 0;
+        const uint8_t *data = NULL;
+
+        if ( BSON_TYPE_DOCUMENT == type )
+            bson_iter_document( iter,&len,&data );
+        else
+            bson_iter_array( iter,&len,&data );
+
+        lua_getuservalue( L,index );
+        lua_rawgeti( L,-1,LAZY_SOURCE );
+        lazy_new( L,data,len,BSON_TYPE_ARRAY == type,-1 );
+        lua_replace( L,-3 );
+        lua_pop( L,1 );
+        return;
+    }
+
+    struct decode_ctx ctx;
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    decode_ctx_init( L,&ctx,&ec );
+    int ret = value_decode( L,iter,&ctx );
+    decode_ctx_done( L,&ctx );
+
+    if ( ret < 0 ) luaL_error( L,"%s",ec.what );
+}
+
+/* push the cache table of proxy at index,create it if create is not 0.
+ * return 0 if no cache and nothing pushed
+ */
+static int lazy_cache( lua_State *L,int index,int create )
+{
+    lua_getuservalue( L,index );
+    if ( LUA_TTABLE == lua_rawgeti( L,-1,LAZY_CACHE ) )
+    {
+        lua_remove( L,-2 );
+        return 1;
+    }
+
+    lua_pop( L,1 );
+    if ( !create )
+    {
+        lua_pop( L,1 );
+        return 0;
+    }
+
+    lua_newtable( L );
+    lua_pushvalue( L,-1 );
+    lua_rawseti( L,-3,LAZY_CACHE );
+    lua_remove( L,-2 );
+
+    return 1;
+}
+
+/* push the value of key(at key_index) from the cache or the raw bytes,
+ * return 0 and push nothing if not found
+ */
+static int lazy_get( lua_State *L,int index,int key_index )
+{
+    struct lbs_lazy *lazy = (struct lbs_lazy *)lua_touserdata( L,index );
+
+    if ( lazy_cache( L,index,0 ) )
+    {
+        lua_pushvalue( L,key_index );
+        if ( LUA_TNIL != lua_rawget( L,-2 ) )
+        {
+            lua_remove( L,-2 );
+            return 1;
+        }
+        lua_pop( L,2 );
+    }
+
+    int key_len = 0;
+    const char *key = NULL;
+    char buffer[INTEGER_KEY_SIZE];
+    if ( lazy->array )
+    {
+        /* lua index start from 1,bson array from 0 */
+        if ( lua_isinteger( L,key_index ) )
+        {
+            lua_Integer i = lua_tointeger( L,key_index );
+            if ( i >= 1 && i <= INT_MAX )
+            {
+                key = index_key( (int)(i - 1),buffer,&key_len );
+            }
+        }
+    }
+    else if ( LUA_TSTRING == lua_type( L,key_index ) )
+    {
+        size_t len = 0;
+        key = lua_tolstring( L,key_index,&len );
+        key_len = (int)len;
+    }
+
+    bson_iter_t iter;
+    if ( !key || !bson_iter_init_from_data( &iter,lazy->data,lazy->len )
+        || !bson_iter_find_w_len( &iter,key,key_len ) )
+    {
+        return 0;
+    }
+
+    lazy_push_value( L,index,&iter );
+    if ( !lua_isnil( L,-1 ) )
+    {
+        lazy_cache( L,index,1 );
+        lua_pushvalue( L,key_index );
+        lua_pushvalue( L,-3 );
+        lua_rawset( L,-3 );
+        lua_pop( L,1 );
+    }
+
+    return 1;
+}
+
+static int lazy_index( lua_State *L )
+{
+    luaL_checkudata( L,1,LBS_LAZY );
+    if ( lazy_get( L,1,2 ) ) return 1;
+
+    /* not a field,maybe a method */
+    lua_pushvalue( L,2 );
+    lua_rawget( L,lua_upvalueindex( 1 ) );
+
+    return 1;
+}
+
+static int lazy_newindex( lua_State *L )
+{
+    return luaL_error( L,"lazy bson document is read only" );
+}
+
+/* a bson array has count elements,a document has no array part */
+static int lazy_len( lua_State *L )
+{
+    struct lbs_lazy *lazy =
+        (struct lbs_lazy *)luaL_checkudata( L,1,LBS_LAZY );
+
+    if ( lazy->count < 0 )
+    {
+        int count = 0;
+        bson_iter_t iter;
+        if ( lazy->array
+            && bson_iter_init_from_data( &iter,lazy->data,lazy->len ) )
+        {
+            while ( bson_iter_next( &iter ) ) ++count;
+        }
+        lazy->count = count;
+    }
+
+    lua_pushinteger( L,lazy->count );
+    return 1;
+}
+
+/* iterator function of __pairs,upvalue 1 is the bson_iter_t */
+static int lazy_next( lua_State *L )
+{
+    struct lbs_lazy *lazy =
+        (struct lbs_lazy *)luaL_checkudata( L,1,LBS_LAZY );
+    bson_iter_t *iter = (bson_iter_t *)lua_touserdata( L,lua_upvalueindex(1) );
+
+    if ( !bson_iter_next( iter ) ) return 0;
+
+    lua_settop( L,1 );
+    if ( lazy->array )
+        lua_pushinteger( L,strtol( bson_iter_key( iter ),NULL,10 ) + 1 );
+    else
+        lua_pushlstring( L,bson_iter_key( iter ),bson_iter_key_len( iter ) );
+
+    /* use the cached value so a sub proxy is the same one as __index */
+    if ( lazy_cache( L,1,0 ) )
+    {
+        lua_pushvalue( L,2 );
+        if ( LUA_TNIL != lua_rawget( L,-2 ) )
+        {
+            lua_remove( L,-2 );
+            return 2;
+        }
+        lua_settop( L,2 );
+    }
+
+    lazy_push_value( L,1,iter );
+    if ( !lua_isnil( L,-1 ) )
+    {
+        lazy_cache( L,1,1 );
+        lua_pushvalue( L,2 );
+        lua_pushvalue( L,-3 );
+        lua_rawset( L,-3 );
+        lua_pop( L,1 );
+    }
+
+    return 2;
+}
+
+static int lazy_pairs( lua_State *L )
+{
+    struct lbs_lazy *lazy =
+        (struct lbs_lazy *)luaL_checkudata( L,1,LBS_LAZY );
+
+    bson_iter_t *iter = (bson_iter_t *)lua_newuserdata( L,sizeof(bson_iter_t) );
+    if ( !bson_iter_init_from_data( iter,lazy->data,lazy->len ) )
+    {
+        return luaL_error( L,"invalid bson document" );
+    }
+
+    lua_pushcclosure( L,lazy_next,1 );
+    lua_pushvalue( L,1 );
+    lua_pushnil( L );
+
+    return 3;
+}
+
+/* decode the whole document into a plain lua table */
+static int lazy_materialize( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    struct lbs_lazy *lazy =
+        (struct lbs_lazy *)luaL_checkudata( L,1,LBS_LAZY );
+
+    bson_iter_t iter;
+    if ( !bson_iter_init_from_data( &iter,lazy->data,lazy->len ) )
+    {
+        return luaL_error( L,"invalid bson document" );
+    }
+
+    struct decode_ctx ctx;
+    decode_ctx_init( L,&ctx,&ec );
+
+    bson_type_t type = lazy->array ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT;
+    if ( bson_decode( L,&iter,type,&ctx ) < 0 )
+    {
+        return luaL_error( L,"%s",ec.what );
+    }
+
+    decode_ctx_done( L,&ctx );
+    return 1;
+}
+
+/* proxy,error = lazy( buffer,nothrow,offset,length ) */
+static int lbs_lazy( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    bson_t doc;
+    int nothrow = lua_toboolean( L,2 );
+    if ( buffer_doc_init( L,1,&doc,&ec ) < 0 )
+    {
+        if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+        lua_pushnil( L );
+        lua_pushstring( L,ec.what );
+        return 2;
+    }
+
+    lazy_new( L,bson_get_data( &doc ),doc.len,0,1 );
+    return 1;
+}
+
+static const luaL_Reg lazy_methods[] =
+{
+    {"materialize", lazy_materialize},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lazy_meta[] =
+{
+    {"__newindex", lazy_newindex},
+    {"__len", lazy_len},
+    {"__pairs", lazy_pairs},
+    {NULL, NULL}
+};
+
+/* ===========================PATH EXTRACTION=============================== */
+
+/* get fields by dotted path,eg. "header.cmd","list.3.id",without decoding
+ * the whole document.all paths are resolved in one scan:each level of the
+ * document is iterated once,and only sub documents which some path go
+ * through are entered
+ */
+#define GET_MAX_PATH  64
+#define GET_MAX_DEPTH 32
+
+struct get_path
+{
+    int depth;                       /* number of segments */
+    const char *seg[GET_MAX_DEPTH];
+    int seg_len[GET_MAX_DEPTH];
+};
+
+/* split path by '.' */
+static int get_path_parse( struct get_path *gp,const char *path,size_t len )
+{
+    const char *end = path + len;
+
+    gp->depth = 0;
+    for ( ;; )
+    {
+        const char *dot = (const char *)memchr( path,'.',end - path );
+        if ( gp->depth >= GET_MAX_DEPTH ) return -1;
+
+        gp->seg[gp->depth] = path;
+        gp->seg_len[gp->depth] = (int)((dot ? dot : end) - path);
+        ++gp->depth;
+
+        if ( !dot ) break;
+        path = dot + 1;
+    }
+
+    return 0;
+}
+
+/* resolve paths(indexes in list) at level in the document iter point to.
+ * value of path i replace the stack slot base + i
+ */
+static int get_walk( lua_State *L,bson_iter_t *iter,struct get_path *paths,
+    const int *list,int n,int level,int base,struct decode_ctx *ctx )
+{
+    int remain = n;
+    int done[GET_MAX_PATH] = { 0 }; /* a path match the first key only */
+
+    while ( remain > 0 && bson_iter_next( iter ) )
+    {
+        int m = 0;
+        int sub[GET_MAX_PATH];
+        const char *key = bson_iter_key( iter );
+        int key_len = (int)bson_iter_key_len( iter );
+
+        for ( int i = 0;i < n;i ++ )
+        {
+            struct get_path *gp = paths + list[i];
+            if ( done[i] || gp->seg_len[level] != key_len
+                || 0 != memcmp( gp->seg[level],key,key_len ) )
+            {
+                continue;
+            }
+
+            done[i] = 1;
+            --remain;
+            if ( level == gp->depth - 1 )
+            {
+                if ( value_decode( L,iter,ctx ) < 0 ) return -1;
+                lua_replace( L,base + list[i] );
+            }
+            else if ( BSON_ITER_HOLDS_DOCUMENT( iter )
+                || BSON_ITER_HOLDS_ARRAY( iter ) )
+            {
+                sub[m++] = list[i];
+            }
+        }
+
+        if ( m > 0 )
+        {
+            bson_iter_t child;
+            if ( !bson_iter_recurse( iter,&child ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "bson document iter recurse error" );
+                return -1;
+            }
+            if ( get_walk( L,&child,paths,sub,m,level + 1,base,ctx ) < 0 )
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* ... = get( buffer,path,... )
+ * return the value of each path,nil if not found.a array index in path
+ * is the raw bson key,which start from 0
+ */
+static int lbs_get( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    int n = lua_gettop( L ) - 1;
+    luaL_argcheck( L,n <= GET_MAX_PATH,GET_MAX_PATH + 2,"too many paths" );
+
+    struct get_path paths[GET_MAX_PATH];
+    int list[GET_MAX_PATH];
+    for ( int i = 0;i < n;i ++ )
+    {
+        size_t len = 0;
+        const char *path = luaL_checklstring( L,i + 2,&len );
+        if ( get_path_parse( paths + i,path,len ) < 0 )
+        {
+            return luaL_argerror( L,i + 2,"path too deep" );
+        }
+        list[i] = i;
+    }
+
+    /* paths follow the buffer,copy it on top so buffer_doc_init do not take
+     * paths as offset and length
+     */
+    bson_t doc;
+    lua_pushvalue( L,1 );
+    if ( buffer_doc_init( L,lua_gettop( L ),&doc,&ec ) < 0 )
+    {
+        return luaL_error( L,"%s",ec.what );
+    }
+
+    luaL_checkstack( L,n + LUA_MINSTACK,"too many paths" );
+
+    /* result slots */
+    int base = lua_gettop( L ) + 1;
+    for ( int i = 0;i < n;i ++ ) lua_pushnil( L );
+
+    struct decode_ctx ctx;
+    decode_ctx_init( L,&ctx,&ec );
+
+    bson_iter_t iter;
+    if ( !bson_iter_init( &iter,&doc )
+        || get_walk( L,&iter,paths,list,n,0,base,&ctx ) < 0 )
+    {
+        if ( !ec.what[0] ) ERROR_LOG( (&ec),LBS_ERROR_BSON,
+            "invalid bson document" );
+        return luaL_error( L,"%s",ec.what );
+    }
+
+    decode_ctx_done( L,&ctx );
+    return n;
+}
+
+/* ==========================REUSABLE ENCODER=============================== */
+
+/* a encoder keep one buffer across calls.the document is built in the
+ * buffer by a bson_writer_t and rollback after the result was pushed,so
+ * a steady state encode do no malloc at all.the buffer grow as libbson
+ * need and shrink when it stay much bigger than recent documents.
+ */
+#define LBS_ENCODER          "lua_bson.encoder"
+#define ENCODER_DEFAULT_SIZE 1024
+#define ENCODER_SHRINK_CHECK 1024 /* check shrink every N encode */
+
+struct lbs_encoder
+{
+    bson_writer_t *writer;
+    uint8_t *buffer;
+    size_t size;        /* buffer capacity */
+    size_t min_size;    /* never shrink below this */
+    size_t peak;        /* max document size since last shrink check */
+    unsigned int count; /* encode count since last shrink check */
+    int busy;           /* a document begin but not rollback yet */
+};
+
+static void encoder_reset( struct lbs_encoder *encoder,size_t size )
+{
+    if ( encoder->writer ) bson_writer_destroy( encoder->writer );
+
+    encoder->buffer = (uint8_t *)bson_realloc( encoder->buffer,size );
+    encoder->size   = size;
+    encoder->writer = bson_writer_new(
+        &encoder->buffer,&encoder->size,0,bson_realloc_ctx,NULL );
+    encoder->busy   = 0;
+}
+
+/* release memory when the buffer is 4 times larger than any document
+ * encoded in the last ENCODER_SHRINK_CHECK calls
+ */
+static void encoder_adapt( struct lbs_encoder *encoder,size_t len )
+{
+    if ( len > encoder->peak ) encoder->peak = len;
+    if ( ++encoder->count < ENCODER_SHRINK_CHECK ) return;
+
+    size_t size = encoder->min_size;
+    while ( size < encoder->peak * 2 ) size *= 2;
+
+    if ( encoder->size > size * 2 ) encoder_reset( encoder,size );
+
+    encoder->peak  = 0;
+    encoder->count = 0;
+}
+
+static bson_t *encoder_begin( struct lbs_encoder *encoder )
+{
+    /* last encode was interrupted by a lua error(eg. out of memory while
+     * pushing the result),the writer was never rollback
+     */
+    if ( encoder->busy ) bson_writer_rollback( encoder->writer );
+
+    bson_t *doc = NULL;
+    bson_writer_begin( encoder->writer,&doc );
+    encoder->busy = 1;
+
+    return doc;
+}
+
+/* push the document built in writer and rollback the writer,so next
+ * encode start at the same buffer again
+ */
+static int encoder_result( lua_State *L,struct lbs_encoder *encoder,
+    bson_t *doc,int err,int nothrow,struct error_collector *ec )
+{
+    size_t len = doc->len;
+    if ( 0 == err )
+    {
+        lua_pushlstring( L,(const char *)bson_get_data( doc ),len );
+    }
+
+    bson_writer_rollback( encoder->writer );
+    encoder->busy = 0;
+    encoder_adapt( encoder,len );
+
+    if ( 0 == err ) return 1;
+
+    if ( !nothrow )
+    {
+        luaL_error( L,"%s",ec->what );
+        return 0; /* in fact,it never return */
+    }
+
+    lua_pushnil( L ); /* fail,make sure buffer is nil */
+    lua_pushstring( L,ec->what );
+
+    return 2;
+}
+
+/* buffer,error = encoder:encode( tbl,nothrow ) */
+static int encoder_encode( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    struct lbs_encoder *encoder =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_ENCODER );
+    int nothrow = lua_toboolean( L,3 );
+
+    if ( !lua_istable( L,2 ) )
+    {
+        ERROR_LOG( (&ec),LBS_ERROR_TYPE,"argument #1 table expected,got %s",
+                    lua_typename( L,lua_type(L,2) ) );
+        if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+        lua_pushnil( L );
+        lua_pushstring( L,ec.what );
+        return 2;
+    }
+
+    bson_t *doc = encoder_begin( encoder );
+
+    int err = lbs_do_encode_into( L,doc,2,NULL,&ec );
+    return encoder_result( L,encoder,doc,err,nothrow,&ec );
+}
+
+/* buffer,error = encoder:encode_stack( nothrow,... ) */
+static int encoder_encode_stack( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    struct lbs_encoder *encoder =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_ENCODER );
+    int nothrow = lua_toboolean( L,2 );
+
+    bson_t *doc = encoder_begin( encoder );
+
+    int err = lbs_do_encode_stack( L,doc,3,&ec );
+    return encoder_result( L,encoder,doc,err,nothrow,&ec );
+}
+
+/* the retained buffer capacity,for debug and test */
+static int encoder_capacity( lua_State *L )
+{
+    struct lbs_encoder *encoder =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_ENCODER );
+
+    lua_pushinteger( L,(lua_Integer)encoder->size );
+    return 1;
+}
+
+/* __gc of both encoder and writer */
+static int encoder_gc( lua_State *L )
+{
+    struct lbs_encoder *encoder = (struct lbs_encoder *)lua_touserdata( L,1 );
+
+    if ( encoder->writer )
+    {
+        bson_writer_destroy( encoder->writer );
+        encoder->writer = NULL;
+    }
+    if ( encoder->buffer )
+    {
+        bson_free( encoder->buffer );
+        encoder->buffer = NULL;
+    }
+    MEM_UNHOLD();
+
+    return 0;
+}
+
+/* create a encoder userdata with metatable name and push it,the initial
+ * buffer size is at index
+ */
+static struct lbs_encoder *encoder_new( lua_State *L,
+    int index,const char *name )
+{
+    lua_Integer size = luaL_optinteger( L,index,ENCODER_DEFAULT_SIZE );
+    luaL_argcheck( L,size >= 64 && size <= INT_MAX,index,"invalid buffer size" );
+
+    struct lbs_encoder *encoder = (struct lbs_encoder *)
+        lua_newuserdata( L,sizeof(struct lbs_encoder) );
+    memset( encoder,0,sizeof(struct lbs_encoder) );
+
+    /* round up to power of 2 as libbson grow buffer that way */
+    size_t min_size = 64;
+    while ( min_size < (size_t)size ) min_size *= 2;
+
+    encoder->min_size = min_size;
+    luaL_setmetatable( L,name );
+    MEM_HOLD();
+    encoder_reset( encoder,min_size );
+
+    return encoder;
+}
+
+/* encoder = encoder( size ),size is the initial buffer size */
+static int lbs_encoder( lua_State *L )
+{
+    encoder_new( L,1,LBS_ENCODER );
+    return 1;
+}
+
+static const luaL_Reg encoder_lib[] =
+{
+    {"encode", encoder_encode},
+    {"encode_stack", encoder_encode_stack},
+    {"capacity", encoder_capacity},
+    {"__gc", encoder_gc},
+    {NULL, NULL}
+};
+
+/* ==============================BATCH WRITER================================ */
+
+/* a writer append many documents into one buffer as a concatenated bson
+ * stream,the format read by decode_iter.it share the struct of encoder,
+ * but documents are kept by bson_writer_end instead of rollback
+ */
+#define LBS_WRITER "lua_bson.writer"
+
+/* ok,error = writer:append( tbl,nothrow ) */
+static int writer_append( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    struct lbs_encoder *writer =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_WRITER );
+    int nothrow = lua_toboolean( L,3 );
+
+    if ( !lua_istable( L,2 ) )
+    {
+        ERROR_LOG( (&ec),LBS_ERROR_TYPE,"argument #1 table expected,got %s",
+                    lua_typename( L,lua_type(L,2) ) );
+    }
+    else
+    {
+        bson_t *doc = encoder_begin( writer );
+        int err = lbs_do_encode_into( L,doc,2,NULL,&ec );
+
+        /* drop the half-built document on error */
+        if ( 0 == err )
+            bson_writer_end( writer->writer );
+        else
+            bson_writer_rollback( writer->writer );
+        writer->busy = 0;
+
+        if ( 0 == err )
+        {
+            lua_pushboolean( L,1 );
+            return 1;
+        }
+    }
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+/* total bytes of all appended documents */
+static int writer_size( lua_State *L )
+{
+    struct lbs_encoder *writer =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_WRITER );
+
+    lua_pushinteger( L,(lua_Integer)bson_writer_get_length( writer->writer ) );
+    return 1;
+}
+
+/* get all appended documents as one string,the writer is not cleared */
+static int writer_tostring( lua_State *L )
+{
+    struct lbs_encoder *writer =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_WRITER );
+
+    lua_pushlstring( L,(const char *)writer->buffer,
+        bson_writer_get_length( writer->writer ) );
+    return 1;
+}
+
+/* size,error = writer:flush( file_or_callback )
+ * write all appended documents to a lua file handle,or pass them to a
+ * callback as one string,then clear the writer.the writer keep it's
+ * buffer for next batch.if callback raise a error,nothing is cleared
+ */
+static int writer_flush( lua_State *L )
+{
+    struct lbs_encoder *writer =
+        (struct lbs_encoder *)luaL_checkudata( L,1,LBS_WRITER );
+    size_t len = bson_writer_get_length( writer->writer );
+
+    if ( lua_isfunction( L,2 ) )
+    {
+        lua_pushvalue( L,2 );
+        lua_pushlstring( L,(const char *)writer->buffer,len );
+        lua_call( L,1,0 );
+    }
+    else
+    {
+        luaL_Stream *stream =
+            (luaL_Stream *)luaL_checkudata( L,2,LUA_FILEHANDLE );
+        luaL_argcheck( L,stream->closef,2,"attempt to use a closed file" );
+
+        if ( len > 0 && fwrite( writer->buffer,1,len,stream->f ) != len )
+        {
+            return luaL_fileresult( L,0,NULL );
+        }
+    }
+
+    /* bson_writer_t can't rewind,create a new one over the same buffer */
+    encoder_reset( writer,writer->size );
+
+    lua_pushinteger( L,(lua_Integer)len );
+    return 1;
+}
+
+/* writer = writer( size ),size is the initial buffer size */
+static int lbs_writer( lua_State *L )
+{
+    encoder_new( L,1,LBS_WRITER );
+    return 1;
+}
+
+static const luaL_Reg writer_lib[] =
+{
+    {"append", writer_append},
+    {"size", writer_size},
+    {"flush", writer_flush},
+    {"tostring", writer_tostring},
+    {"__gc", encoder_gc},
+    {NULL, NULL}
+};
+
+/* ============================SCHEMA CODEC================================= */
+
+/* a codec compiled from a schema like
+ * { id = "integer",name = "string",pos = { x = "double",y = "double" } }
+ * fields are sorted by key and flattened into one array,the fields of a sub
+ * schema are contiguous.encode get each field by rawget with a prebuilt key
+ * string,no lua_next,no array detection
+ */
+#define LBS_CODEC "lua_bson.codec"
+
+#define SCHEMA_MAX_FIELD 256 /* fields in one level */
+#define SCHEMA_MAX_DEPTH 32
+#define SCHEMA_MAX_EXACT ( (lua_Integer)1 << 53 ) /* integer exact in double */
+
+enum
+{
+    SCHEMA_ANY = 0, /* any value,encode by the generic path */
+    SCHEMA_STRING,
+    SCHEMA_INTEGER,
+    SCHEMA_DOUBLE,
+    SCHEMA_NUMBER,  /* integer or double */
+    SCHEMA_BOOLEAN,
+    SCHEMA_DOCUMENT /* a sub schema */
+};
+
+static const char *schema_type_name[] =
+{
+    "any","string","integer","double","number","boolean",NULL
+};
+
+struct schema_field
+{
+    int type;
+    int key_len;
+    int first; /* sub schema only,index of first child field */
+    int count; /* sub schema only,number of child fields */
+    char key[MAX_KEY_LENGTH];
+};
+
+/* the key strings of fields are in the uservalue table,field i at i + 1 */
+struct lbs_codec
+{
+    int count;  /* total fields */
+    int root;   /* fields at top level,they are at 0 ~ root - 1 */
+    int strict; /* look for keys not in schema in every table */
+    struct schema_field fields[1];
+};
+
+/* count fields of the schema at index,include all sub schema */
+static int schema_count( lua_State *L,int index,int depth,int *level )
+{
+    if ( depth > SCHEMA_MAX_DEPTH ) luaL_error( L,"schema too deep" );
+    luaL_checkstack( L,3,"schema too deep" );
+
+    int total = 0;
+    *level = 0;
+
+    lua_pushnil( L );
+    while ( lua_next( L,index ) )
+    {
+        size_t len = 0;
+        if ( LUA_TSTRING != lua_type( L,-2 ) )
+        {
+            luaL_error( L,"schema key must be a string" );
+        }
+        const char *key = lua_tolstring( L,-2,&len );
+        if ( 0 == len || len >= MAX_KEY_LENGTH || strlen( key ) != len )
+        {
+            luaL_error( L,"invalid schema key:%s",key );
+        }
+
+        if ( LUA_TTABLE == lua_type( L,-1 ) )
+        {
+            int sub = 0;
+            total += schema_count( L,lua_gettop( L ),depth + 1,&sub );
+            if ( 0 == sub ) luaL_error( L,"empty sub schema:%s",key );
+        }
+        else if ( LUA_TSTRING != lua_type( L,-1 ) )
+        {
+            luaL_error( L,"invalid schema type of %s",key );
+        }
+
+        if ( ++(*level) > SCHEMA_MAX_FIELD )
+        {
+            luaL_error( L,"too many fields in schema" );
+        }
+        ++total;
+        lua_pop( L,1 );
+    }
+
+    return total;
+}
+
+static int schema_key_cmp( const void *a,const void *b )
+{
+    return strcmp( *(const char **)a,*(const char **)b );
+}
+
+/* fill the fields of schema at index into fields[first ~ first + count],
+ * next is the first free field
+ */
+static void schema_fill( lua_State *L,int index,int uv,
+    struct lbs_codec *codec,int first,int *next )
+{
+    int count = 0;
+    const char *keys[SCHEMA_MAX_FIELD];
+
+    luaL_checkstack( L,4,"schema too deep" );
+
+    /* the key strings are referenced by the schema table,it's safe to keep
+     * the pointers while schema is on the stack
+     */
+    lua_pushnil( L );
+    while ( lua_next( L,index ) )
+    {
+        keys[count++] = lua_tostring( L,-2 );
+        lua_pop( L,1 );
+    }
+    qsort( keys,count,sizeof(const char *),schema_key_cmp );
+
+    for ( int i = 0;i < count;i ++ )
+    {
+        struct schema_field *field = codec->fields + first + i;
+        field->key_len = (int)strlen( keys[i] );
+        memcpy( field->key,keys[i],field->key_len + 1 );
+
+        lua_pushlstring( L,field->key,field->key_len );
+        lua_rawseti( L,uv,first + i + 1 );
+
+        lua_getfield( L,index,field->key );
+        if ( LUA_TTABLE == lua_type( L,-1 ) )
+        {
+            int sub = lua_gettop( L );
+
+            field->type  = SCHEMA_DOCUMENT;
+            field->first = *next;
+            field->count = 0;
+            lua_pushnil( L );
+            while ( lua_next( L,sub ) )
+            {
+                ++field->count;
+                lua_pop( L,1 );
+            }
+
+            *next += field->count;
+            schema_fill( L,sub,uv,codec,field->first,next );
+        }
+        else
+        {
+            const char *name = lua_tostring( L,-1 );
+
+            int type = 0;
+            while ( schema_type_name[type]
+                && 0 != strcmp( schema_type_name[type],name ) ) ++type;
+            if ( !schema_type_name[type] )
+            {
+                luaL_error( L,"invalid schema type %s of %s",name,field->key );
+            }
+
+            field->type  = type;
+            field->first = 0;
+            field->count = 0;
+        }
+        lua_pop( L,1 );
+    }
+}
+
+/* encode the fields of a level.return 1 if the table do not match the
+ * schema,the caller fall back to generic path.a field with nil value is
+ * skipped,a key not in schema is a mismatch too.keys are only iterated
+ * when some field is nil or codec is strict,as a table with every field
+ * is taken as the fixed shape
+ */
+static int schema_encode( lua_State *L,struct lbs_codec *codec,int uv,
+    int max_depth,int index,bson_t *doc,int first,int count,
+    struct encode_ctx *ctx )
+{
+    if ( ctx->depth >= max_depth )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,
+            "table too deep,max depth is %d",max_depth );
+        return -1;
+    }
+    if ( lua_gettop( L ) > MAX_LUA_STACK || !lua_checkstack( L,2 ) )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"stack overflow" );
+        return -1;
+    }
+
+    /* a mismatch or error discard ctx,only a matched level go back */
+    if ( ++ctx->depth > ctx->max_depth ) ctx->max_depth = ctx->depth;
+
+    int matched = 0;
+    for ( int i = first;i < first + count;i ++ )
+    {
+        const struct schema_field *field = codec->fields + i;
+
+        lua_rawgeti( L,uv,i + 1 );
+        int ty = lua_rawget( L,index );
+        if ( LUA_TNIL == ty )
+        {
+            lua_pop( L,1 );
+            continue;
+        }
+
+        ++matched;
+        int value = lua_gettop( L );
+        switch ( field->type )
+        {
+            case SCHEMA_STRING :
+            {
+                if ( LUA_TSTRING != ty ) return 1;
+
+                size_t len = 0;
+                const char *val = lua_tolstring( L,value,&len );
+                bson_append_utf8( doc,field->key,field->key_len,val,(int)len );
+            }break;
+            case SCHEMA_INTEGER :
+            {
+                if ( !lua_isinteger( L,value ) ) return 1;
+
+                lua_Integer val = lua_tointeger( L,value );
+                if ( lua_isbit32( val ) )
+                    bson_append_int32( doc,field->key,field->key_len,(int)val );
+                else
+                    bson_append_int64( doc,field->key,field->key_len,val );
+            }break;
+            case SCHEMA_DOUBLE :
+            {
+                /* a integral value like hp = 10 is a double too,if it
+                 * can be exact in a double
+                 */
+                if ( LUA_TNUMBER != ty ) return 1;
+                if ( lua_isinteger( L,value ) )
+                {
+                    lua_Integer val = lua_tointeger( L,value );
+                    if ( val > SCHEMA_MAX_EXACT || val < -SCHEMA_MAX_EXACT )
+                    {
+                        return 1;
+                    }
+                }
+
+                double val = lua_tonumber( L,value );
+                bson_append_double( doc,field->key,field->key_len,val );
+            }break;
+            case SCHEMA_NUMBER :
+            case SCHEMA_ANY :
+            {
+                if ( SCHEMA_NUMBER == field->type && LUA_TNUMBER != ty )
+                {
+                    return 1;
+                }
+                if ( value_encode(
+                    L,doc,field->key,field->key_len,value,ctx ) < 0 )
+                {
+                    return -1;
+                }
+            }break;
+            case SCHEMA_BOOLEAN :
+            {
+                if ( LUA_TBOOLEAN != ty ) return 1;
+
+                bson_append_bool(
+                    doc,field->key,field->key_len,lua_toboolean( L,value ) );
+            }break;
+            case SCHEMA_DOCUMENT :
+            {
+                /* a table forced to be a array by __array don't match */
+                if ( LUA_TTABLE != ty
+                    || ARRAY_FORCE == array_metafield( L,value,ctx ) )
+                {
+                    return 1;
+                }
+
+                bson_t child;
+                bson_append_document_begin(
+                    doc,field->key,field->key_len,&child );
+                /* always end the child,or doc can't be reinit on mismatch */
+                int ret = schema_encode( L,codec,uv,max_depth,
+                    value,&child,field->first,field->count,ctx );
+                bson_append_document_end( doc,&child );
+                if ( 0 != ret ) return ret;
+            }break;
+            default : assert( 0 );break;
+        }
+
+        lua_pop( L,1 );
+    }
+
+    if ( matched == count && !codec->strict )
+    {
+        --ctx->depth;
+        return 0;
+    }
+
+    /* every key found by schema,any more key is not in schema */
+    int keys = 0;
+    lua_pushnil( L );
+    while ( lua_next( L,index ) != 0 )
+    {
+        lua_pop( L,1 );
+        if ( ++keys > matched )
+        {
+            lua_pop( L,1 );
+            return 1;
+        }
+    }
+
+    --ctx->depth;
+    return 0;
+}
+
+/* decode a document with the schema of a level.a key in schema reuse the
+ * prebuilt string,the others are decoded as generic
+ */
+static int schema_decode( lua_State *L,struct lbs_codec *codec,int uv,
+    int max_depth,bson_iter_t *iter,int first,int count,
+    struct decode_ctx *ctx )
+{
+    if ( ctx->depth >= max_depth )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,
+            "document too deep,max depth is %d",max_depth );
+        return -1;
+    }
+    if ( lua_gettop(L) > MAX_LUA_STACK || !lua_checkstack(L,4) )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"bson_decode stack overflow" );
+        return -1;
+    }
+    if ( ++ctx->depth > ctx->max_depth ) ctx->max_depth = ctx->depth;
+
+    lua_createtable( L,0,count );
+
+    int pos = first;
+    while ( bson_iter_next( iter ) )
+    {
+        const char *key = bson_iter_key( iter );
+        int key_len = (int)bson_iter_key_len( iter );
+
+        /* document encoded by this codec has the same order as fields */
+        const struct schema_field *field = NULL;
+        for ( int i = 0;i < count && !field;i ++ )
+        {
+            const struct schema_field *cur = codec->fields + pos;
+            if ( cur->key_len == key_len && 0 == memcmp( cur->key,key,key_len ) )
+            {
+                field = cur;
+            }
+            if ( ++pos >= first + count ) pos = first;
+        }
+
+        if ( !field )
+        {
+            push_key( L,key,key_len,ctx );
+            if ( value_decode( L,iter,ctx ) < 0 )
+            {
+                lua_pop( L,2 );
+                return      -1;
+            }
+            lua_rawset( L,-3 );
+            continue;
+        }
+
+        lua_rawgeti( L,uv,(int)( field - codec->fields ) + 1 );
+        if ( SCHEMA_DOCUMENT == field->type && BSON_ITER_HOLDS_DOCUMENT( iter ) )
+        {
+            bson_iter_t sub_iter;
+            if ( !bson_iter_recurse( iter,&sub_iter ) )
+            {
+                lua_pop( L,2 );
+                ERROR_LOG( ctx->ec,LBS_ERROR_BSON,
+                    "bson document iter recurse error" );
+                return -1;
+            }
+            if ( schema_decode( L,codec,uv,max_depth,
+                &sub_iter,field->first,field->count,ctx ) < 0 )
+            {
+                lua_pop( L,2 );
+                return      -1;
+            }
+        }
+        else if ( value_decode( L,iter,ctx ) < 0 )
+        {
+            lua_pop( L,2 );
+            return      -1;
+        }
+        lua_rawset( L,-3 );
+    }
+
+    --ctx->depth;
+    return 0;
+}
+
+/* buffer,error = codec:encode( tbl,nothrow ) */
+static int codec_encode( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    struct lbs_codec *codec =
+        (struct lbs_codec *)luaL_checkudata( L,1,LBS_CODEC );
+    int nothrow = lua_toboolean( L,3 );
+
+    if ( !lua_istable( L,2 ) )
+    {
+        ERROR_LOG( (&ec),LBS_ERROR_TYPE,"argument #1 table expected,got %s",
+                    lua_typename( L,lua_type(L,2) ) );
+        if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+        lua_pushnil( L );
+        lua_pushstring( L,ec.what );
+        return 2;
+    }
+
+    lua_settop( L,3 );
+    lua_getuservalue( L,1 );
+
+    struct encode_ctx ctx;
+    ENCODE_CTX_INIT( &ctx,&ec );
+
+    bson_t doc;
+    bson_init( &doc );
+
+    double beg = stats_enabled ? stats_clock() : 0;
+    int ret = schema_encode( L,codec,4,
+        engine_max_depth( L ),2,&doc,0,codec->root,&ctx );
+    if ( ret > 0 )
+    {
+        /* not match the schema,encode it as a normal table */
+        lua_settop( L,4 );
+        bson_reinit( &doc );
+        ret = lbs_do_encode_into( L,&doc,2,NULL,&ec );
+    }
+    else if ( stats_enabled )
+    {
+        stats_record( STATS_ENCODE,beg,ret,ec.kind,doc.len,0 );
+    }
+
+    if ( ret < 0 )
+    {
+        bson_destroy( &doc );
+        if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+        lua_pushnil( L );
+        lua_pushstring( L,ec.what );
+        return 2;
+    }
+
+    lua_pushlstring( L,(const char *)bson_get_data( &doc ),doc.len );
+    bson_destroy( &doc );
+
+    return 1;
+}
+
+/* tbl,error = codec:decode( buffer,nothrow,offset,length ) */
+static int codec_decode( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    struct lbs_codec *codec =
+        (struct lbs_codec *)luaL_checkudata( L,1,LBS_CODEC );
+    int nothrow = lua_toboolean( L,3 );
+
+    bson_t doc;
+    bson_iter_t iter;
+    if ( buffer_doc_init( L,2,&doc,&ec ) >= 0 )
+    {
+        if ( !bson_iter_init( &iter,&doc ) )
+        {
+            ERROR_LOG( (&ec),LBS_ERROR_BSON,"invalid bson document" );
+        }
+        else
+        {
+            lua_getuservalue( L,1 );
+            int uv = lua_gettop( L );
+
+            struct decode_ctx ctx;
+            decode_ctx_init( L,&ctx,&ec );
+
+            double beg = stats_enabled ? stats_clock() : 0;
+            int ret = schema_decode( L,codec,uv,
+                engine_max_depth( L ),&iter,0,codec->root,&ctx );
+            if ( stats_enabled )
+            {
+                stats_record( STATS_DECODE,beg,ret,ec.kind,doc.len,0 );
+            }
+
+            if ( ret >= 0 )
+            {
+                decode_ctx_done( L,&ctx );
+                return 1;
+            }
+        }
+    }
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+/* codec = compile( schema,strict ) */
+static int lbs_compile( lua_State *L )
+{
+    luaL_checktype( L,1,LUA_TTABLE );
+    int strict = lua_toboolean( L,2 );
+    lua_settop( L,1 );
+
+    int root  = 0;
+    int total = schema_count( L,1,0,&root );
+    luaL_argcheck( L,total > 0,1,"empty schema" );
+
+    struct lbs_codec *codec = (struct lbs_codec *)lua_newuserdata( L,
+        sizeof(struct lbs_codec) + sizeof(struct schema_field) * ( total - 1 ) );
+    codec->count  = total;
+    codec->root   = root;
+    codec->strict = strict;
+
+    lua_createtable( L,total,0 );
+    int next = root;
+    schema_fill( L,1,3,codec,0,&next );
+    assert( next == total );
+    lua_setuservalue( L,2 );
+
+    luaL_setmetatable( L,LBS_CODEC );
+
+    return 1;
+}
+
+static const luaL_Reg codec_lib[] =
+{
+    {"encode",codec_encode},
+    {"decode",codec_decode},
+    {NULL,NULL}
+};
+
+/* ===========================USERDATA BUFFER=============================== */
+
+/* the bytes of a full userdata,or a lightuserdata with explicit size,so
+ * bson go straight to and from a i/o buffer without a lua string
+ */
+static int userdata_buffer( lua_State *L,int index,int size_index,
+    uint8_t **ptr,size_t *size,struct error_collector *ec )
+{
+    switch ( lua_type( L,index ) )
+    {
+        case LUA_TUSERDATA :
+        {
+            /* size_index 0 mean the whole userdata */
+            size_t cap = lua_rawlen( L,index );
+            lua_Integer sz = size_index > 0 ?
+                luaL_optinteger( L,size_index,(lua_Integer)cap ) : (lua_Integer)cap;
+            if ( sz < 0 || (size_t)sz > cap )
+            {
+                ERROR_LOG( ec,LBS_ERROR_SIZE,"size out of range" );
+                return -1;
+            }
+            *size = (size_t)sz;
+        }break;
+        case LUA_TLIGHTUSERDATA :
+        {
+            if ( !lua_isinteger( L,size_index ) )
+            {
+                ERROR_LOG( ec,LBS_ERROR_TYPE,"size of lightuserdata expected" );
+                return -1;
+            }
+            lua_Integer sz = lua_tointeger( L,size_index );
+            if ( sz < 0 )
+            {
+                ERROR_LOG( ec,LBS_ERROR_SIZE,"size out of range" );
+                return -1;
+            }
+            *size = (size_t)sz;
+        }break;
+        default :
+        {
+            ERROR_LOG( ec,LBS_ERROR_TYPE,
+                "argument #%d userdata expected,got %s",
+                index,lua_typename( L,lua_type(L,index) ) );
+            return -1;
+        }
+    }
+
+    *ptr = (uint8_t *)lua_touserdata( L,index );
+    return 0;
+}
+
+/* the caller's buffer can't grow.when libbson want to grow it,move into a
+ * heap buffer so encoding go on safely,and report the overflow at the end
+ */
+struct into_buffer
+{
+    uint8_t *base;
+    size_t size;
+    int overflow;
+};
+
+static void *into_realloc( void *mem,size_t size,void *ctx )
+{
+    struct into_buffer *into = (struct into_buffer *)ctx;
+    if ( mem != into->base ) return bson_realloc( mem,size );
+
+    into->overflow = 1;
+
+    void *heap = bson_malloc( size );
+    memcpy( heap,mem,into->size < size ? into->size : size );
+
+    return heap;
+}
+
+static int encode_into( lua_State *L,uint32_t *len,struct error_collector *ec )
+{
+    uint8_t *base = NULL;
+    size_t size = 0;
+    lua_Integer offset = luaL_optinteger( L,2,0 );
+
+    if ( userdata_buffer( L,1,5,&base,&size,ec ) < 0 ) return -1;
+    if ( !lua_istable( L,3 ) )
+    {
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"argument #3 table expected,got %s",
+            lua_typename( L,lua_type(L,3) ) );
+        return -1;
+    }
+    if ( offset < 0 || (size_t)offset + 5 > size )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"offset out of range" );
+        return -1;
+    }
+
+    struct into_buffer into;
+    into.base = base;
+    into.size = size;
+    into.overflow = 0;
+
+    uint8_t *buffer = base;
+    size_t buffer_size = size;
+    bson_writer_t *writer = bson_writer_new(
+        &buffer,&buffer_size,(size_t)offset,into_realloc,&into );
+
+    bson_t *doc = NULL;
+    int err = bson_writer_begin( writer,&doc ) ? 0 : -1;
+    if ( err < 0 )
+    {
+        ERROR_LOG( ec,LBS_ERROR_MEMORY,"bson writer begin error" );
+    }
+    else if ( ( err = lbs_do_encode_into( L,doc,3,NULL,ec ) ) < 0 )
+    {
+        bson_writer_rollback( writer );
+    }
+    else
+    {
+        *len = doc->len;
+        bson_writer_end( writer );
+    }
+    bson_writer_destroy( writer );
+
+    if ( into.overflow )
+    {
+        bson_free( buffer );
+        if ( err >= 0 )
+        {
+            ERROR_LOG( ec,LBS_ERROR_SIZE,
+                "buffer too small,%u bytes needed",*len );
+            err = -1;
+        }
+    }
+
+    return err;
+}
+
+/* length,error = encode_into( buf,offset,tbl,nothrow,size ),size is the
+ * buffer size,required only for lightuserdata
+ */
+static int lbs_encode_into( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    uint32_t len = 0;
+    int nothrow = lua_toboolean( L,4 );
+
+    if ( encode_into( L,&len,&ec ) >= 0 )
+    {
+        lua_pushinteger( L,len );
+        return 1;
+    }
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+/* init doc over the userdata at index 1,offset at 3 and length at 4 */
+static int userdata_doc_init( lua_State *L,bson_t *doc,struct error_collector *ec )
+{
+    uint8_t *base = NULL;
+    size_t size = 0;
+    lua_Integer offset = luaL_optinteger( L,3,0 );
+
+    if ( LUA_TLIGHTUSERDATA == lua_type( L,1 ) )
+    {
+        /* no size known,the region is just offset + length */
+        if ( userdata_buffer( L,1,4,&base,&size,ec ) < 0 ) return -1;
+        if ( offset < 0 )
+        {
+            ERROR_LOG( ec,LBS_ERROR_SIZE,"offset out of range" );
+            return -1;
+        }
+
+        return doc_init_static( base + offset,size,doc,ec );
+    }
+
+    if ( userdata_buffer( L,1,0,&base,&size,ec ) < 0 ) return -1;
+    if ( offset < 0 || (size_t)offset > size )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"offset out of range" );
+        return -1;
+    }
+
+    size -= (size_t)offset;
+    lua_Integer length = luaL_optinteger( L,4,(lua_Integer)size );
+    if ( length < 0 || (size_t)length > size )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"length out of range" );
+        return -1;
+    }
+
+    return doc_init_static( base + offset,(size_t)length,doc,ec );
+}
+
+/* tbl,error = decode_from( buf,nothrow,offset,length ),length is required
+ * for lightuserdata
+ */
+static int lbs_decode_from( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    bson_t doc;
+    int nothrow = lua_toboolean( L,2 );
+
+    if ( userdata_doc_init( L,&doc,&ec ) >= 0
+        && lbs_do_decode( L,&doc,BSON_TYPE_DOCUMENT,&ec ) >= 0 )
+    {
+        return 1;
+    }
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+/* allocate a plain userdata buffer of size bytes */
+static int lbs_buffer( lua_State *L )
+{
+    lua_Integer size = luaL_checkinteger( L,1 );
+    luaL_argcheck( L,size > 0,1,"invalid buffer size" );
+
+    lua_newuserdata( L,(size_t)size );
+    return 1;
+}
+
+/* ============================MEMORY BACKEND=============================== */
+
+/* libbson memory is routed through mem_vtable when stats enabled or the
+ * backend is not system.lua and pool backend put a header before each
+ * block,which record where the block come from.the backend can only be
+ * changed when no such block or memory holder(encoder,reader) alive.
+ * libbson may allocate in any thread
+ */
+enum
+{
+    MEM_SYSTEM = 0,
+    MEM_LUA,
+    MEM_POOL,
+
+    MEM_MAX
+};
+
+static const char *mem_backend_name[] = { "system","lua","pool",NULL };
+
+/* keep the payload aligned as malloc do */
+struct mem_header
+{
+    size_t size; /* payload size */
+    size_t cls;  /* pool size class,POOL_CLASS_MAX for a malloc block or
+                  * MEM_CLASS_LUA for a lua block
+                  */
+};
+
+#define MEM_HEADER sizeof(struct mem_header)
+
+/* pool block size(header included) classes 32,64,...,4096 */
+#define POOL_MIN_SHIFT 5
+#define POOL_CLASS_MAX 8
+#define POOL_MAX_FREE  256 /* free blocks cached in each class */
+
+#define MEM_CLASS_LUA  ( POOL_CLASS_MAX + 1 )
+
+/* a deferred lua block keep the next one in payload */
+#define MEM_LUA_SIZE(size) \
+    ( ( (size) < sizeof(void *) ? sizeof(void *) : (size) ) + MEM_HEADER )
+
+struct pool_node
+{
+    struct pool_node *next;
+};
+
+struct mem_pool
+{
+    pthread_mutex_t mutex;
+    struct pool_node *free[POOL_CLASS_MAX];
+    int free_count[POOL_CLASS_MAX];
+};
+
+static int mem_backend = MEM_SYSTEM;
+static int mem_installed = 0;
+
+/* lua backend use the allocator of the state select it,the owner.lua
+ * allocator is not thread safe,so only the thread of owner call it.other
+ * threads get malloc blocks,and their frees of lua blocks are deferred to
+ * owner thread.lua blocks still alive when owner closed are leaked
+ */
+static lua_Alloc mem_lua_alloc = NULL; /* NULL if no owner */
+static void *mem_lua_ud = NULL;
+static const struct lbs_engine *mem_lua_owner = NULL;
+static pthread_t mem_lua_thread;
+static struct mem_header *mem_lua_deferred = NULL;
+static pthread_mutex_t mem_lua_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mem_pool mem_pool = { PTHREAD_MUTEX_INITIALIZER,{ NULL },{ 0 } };
+
+static lua_Integer mem_live = 0; /* blocks with header alive */
+
+#define STATS_ADD(field,n) __atomic_add_fetch( &stats.field,n,__ATOMIC_RELAXED )
+
+static inline size_t pool_class( size_t size )
+{
+    size_t cls = 0;
+    size_t block = (size_t)1 << POOL_MIN_SHIFT;
+    while ( block < size + MEM_HEADER && cls < POOL_CLASS_MAX )
+    {
+        block <<= 1;
+        ++cls;
+    }
+
+    return cls;
+}
+
+static struct mem_header *pool_alloc( size_t size )
+{
+    size_t cls = pool_class( size );
+    if ( cls >= POOL_CLASS_MAX )
+    {
+        return (struct mem_header *)malloc( size + MEM_HEADER );
+    }
+
+    struct pool_node *node = NULL;
+
+    pthread_mutex_lock( &mem_pool.mutex );
+    if ( ( node = mem_pool.free[cls] ) )
+    {
+        mem_pool.free[cls] = node->next;
+        --mem_pool.free_count[cls];
+    }
+    pthread_mutex_unlock( &mem_pool.mutex );
+
+    if ( !node )
+        node = malloc( (size_t)1 << ( cls + POOL_MIN_SHIFT ) );
+    else if ( stats_enabled )
+        STATS_ADD( pool_reuse,1 );
+
+    return (struct mem_header *)node;
+}
+
+static void pool_free( struct mem_header *header )
+{
+    size_t cls = header->cls;
+    if ( cls < POOL_CLASS_MAX )
+    {
+        struct pool_node *node = (struct pool_node *)header;
+
+        pthread_mutex_lock( &mem_pool.mutex );
+        if ( mem_pool.free_count[cls] < POOL_MAX_FREE )
+        {
+            node->next = mem_pool.free[cls];
+            mem_pool.free[cls] = node;
+            ++mem_pool.free_count[cls];
+            node = NULL;
+        }
+        pthread_mutex_unlock( &mem_pool.mutex );
+
+        if ( !node ) return;
+    }
+
+    free( header );
+}
+
+/* release all cached pool blocks */
+static void pool_trim()
+{
+    pthread_mutex_lock( &mem_pool.mutex );
+    for ( int i = 0;i < POOL_CLASS_MAX;i ++ )
+    {
+        struct pool_node *node = mem_pool.free[i];
+        while ( node )
+        {
+            struct pool_node *next = node->next;
+            free( node );
+            node = next;
+        }
+        mem_pool.free[i] = NULL;
+        mem_pool.free_count[i] = 0;
+    }
+    pthread_mutex_unlock( &mem_pool.mutex );
+}
+
+/* the lua allocator can be called in this thread */
+static inline int mem_lua_here()
+{
+    return pthread_equal( pthread_self(),mem_lua_thread ) && mem_lua_alloc;
+}
+
+/* free lua blocks deferred by other threads,in owner thread */
+static void mem_lua_drain()
+{
+    pthread_mutex_lock( &mem_lua_mutex );
+    struct mem_header *header = mem_lua_deferred;
+    mem_lua_deferred = NULL;
+    pthread_mutex_unlock( &mem_lua_mutex );
+
+    while ( header )
+    {
+        struct mem_header *next = *(struct mem_header **)( header + 1 );
+        mem_lua_alloc( mem_lua_ud,header,MEM_LUA_SIZE( header->size ),0 );
+        header = next;
+    }
+}
+
+static struct mem_header *mem_lua_new( size_t num_bytes )
+{
+    if ( __atomic_load_n( &mem_lua_deferred,__ATOMIC_RELAXED ) )
+    {
+        mem_lua_drain();
+    }
+
+    struct mem_header *header = (struct mem_header *)
+        mem_lua_alloc( mem_lua_ud,NULL,0,MEM_LUA_SIZE( num_bytes ) );
+    if ( header ) header->cls = MEM_CLASS_LUA;
+
+    return header;
+}
+
+static void mem_lua_free( struct mem_header *header )
+{
+    if ( mem_lua_here() )
+    {
+        mem_lua_alloc( mem_lua_ud,header,MEM_LUA_SIZE( header->size ),0 );
+        return;
+    }
+
+    pthread_mutex_lock( &mem_lua_mutex );
+    if ( mem_lua_owner )
+    {
+        *(struct mem_header **)( header + 1 ) = mem_lua_deferred;
+        mem_lua_deferred = header;
+    }
+    pthread_mutex_unlock( &mem_lua_mutex );
+}
+
+/* stop using the allocator of owner */
+static void mem_lua_close()
+{
+    if ( mem_lua_here() ) mem_lua_drain();
+
+    pthread_mutex_lock( &mem_lua_mutex );
+    mem_lua_owner = NULL;
+    mem_lua_alloc = NULL;
+    mem_lua_ud = NULL;
+    mem_lua_deferred = NULL;
+    pthread_mutex_unlock( &mem_lua_mutex );
+}
+
+static void *mem_malloc( size_t num_bytes )
+{
+    if ( stats_enabled )
+    {
+        STATS_ADD( alloc_count,1 );
+        STATS_ADD( alloc_bytes,(lua_Integer)num_bytes );
+    }
+
+    struct mem_header *header = NULL;
+    switch ( mem_backend )
+    {
+        case MEM_SYSTEM : return malloc( num_bytes );
+        case MEM_LUA :
+        {
+            if ( mem_lua_here() )
+            {
+                header = mem_lua_new( num_bytes );
+            }
+            else if ( ( header = malloc( num_bytes + MEM_HEADER ) ) )
+            {
+                header->cls = POOL_CLASS_MAX;
+            }
+        }break;
+        case MEM_POOL :
+        {
+            if ( ( header = pool_alloc( num_bytes ) ) )
+            {
+                header->cls = pool_class( num_bytes );
+            }
+        }break;
+        default : assert( 0 );break;
+    }
+
+    if ( !header ) return NULL;
+
+    header->size = num_bytes;
+    __atomic_add_fetch( &mem_live,1,__ATOMIC_RELAXED );
+
+    return header + 1;
+}
+
+static void *mem_calloc( size_t n_members,size_t num_bytes )
+{
+    if ( num_bytes && n_members > SIZE_MAX / num_bytes ) return NULL;
+
+    if ( MEM_SYSTEM == mem_backend )
+    {
+        if ( stats_enabled )
+        {
+            STATS_ADD( alloc_count,1 );
+            STATS_ADD( alloc_bytes,(lua_Integer)( n_members * num_bytes ) );
+        }
+        return calloc( n_members,num_bytes );
+    }
+
+    void *mem = mem_malloc( n_members * num_bytes );
+    if ( mem ) memset( mem,0,n_members * num_bytes );
+
+    return mem;
+}
+
+static void mem_free( void *mem )
+{
+    if ( !mem ) return;
+    if ( stats_enabled ) STATS_ADD( free_count,1 );
+
+    if ( MEM_SYSTEM == mem_backend )
+    {
+        free( mem );
+        return;
+    }
+
+    struct mem_header *header = (struct mem_header *)mem - 1;
+    __atomic_sub_fetch( &mem_live,1,__ATOMIC_RELAXED );
+
+    if ( MEM_CLASS_LUA == header->cls )
+    {
+        mem_lua_free( header );
+        return;
+    }
+
+    pool_free( header );
+}
+
+static void *mem_realloc( void *mem,size_t num_bytes )
+{
+    if ( !mem ) return mem_malloc( num_bytes );
+
+    if ( MEM_SYSTEM == mem_backend )
+    {
+        if ( stats_enabled )
+        {
+            STATS_ADD( alloc_count,1 );
+            STATS_ADD( alloc_bytes,(lua_Integer)num_bytes );
+        }
+        return realloc( mem,num_bytes );
+    }
+
+    struct mem_header *header = (struct mem_header *)mem - 1;
+    if ( MEM_CLASS_LUA == header->cls && mem_lua_here() )
+    {
+        if ( stats_enabled )
+        {
+            STATS_ADD( alloc_count,1 );
+            STATS_ADD( alloc_bytes,(lua_Integer)num_bytes );
+        }
+
+        header = (struct mem_header *)mem_lua_alloc( mem_lua_ud,
+            header,MEM_LUA_SIZE( header->size ),MEM_LUA_SIZE( num_bytes ) );
+        if ( !header ) return NULL;
+
+        header->size = num_bytes;
+        return header + 1;
+    }
+
+    /* still fit in the same pool block */
+    size_t cls = pool_class( num_bytes );
+    if ( cls < POOL_CLASS_MAX && cls == header->cls )
+    {
+        header->size = num_bytes;
+        return mem;
+    }
+
+    /* large block stay large,let system realloc move it */
+    if ( POOL_CLASS_MAX == cls && POOL_CLASS_MAX == header->cls )
+    {
+        if ( stats_enabled )
+        {
+            STATS_ADD( alloc_count,1 );
+            STATS_ADD( alloc_bytes,(lua_Integer)num_bytes );
+        }
+
+        header = (struct mem_header *)realloc( header,num_bytes + MEM_HEADER );
+        if ( !header ) return NULL;
+
+        header->size = num_bytes;
+        return header + 1;
+    }
+
+    void *new_mem = mem_malloc( num_bytes );
+    if ( !new_mem ) return NULL;
+
+    memcpy( new_mem,mem,header->size < num_bytes ? header->size : num_bytes );
+    mem_free( mem );
+
+    return new_mem;
+}
+
+static bson_mem_vtable_t mem_vtable =
+{
+    mem_malloc,mem_calloc,mem_realloc,mem_free,{ 0 }
+};
+
+/* install mem_vtable only when needed,system backend without stats cost
+ * nothing.system backend has no header,so switch it is always safe
+ */
+static void mem_update_vtable()
+{
+    int need = stats_enabled || MEM_SYSTEM != mem_backend;
+    if ( need == mem_installed ) return;
+
+    if ( need )
+        bson_mem_set_vtable( &mem_vtable );
+    else
+        bson_mem_restore_vtable();
+
+    mem_installed = need;
+}
+
+/* name = memory( backend ),backend is "system","lua" or "pool",return the
+ * backend in use.without argument,just return it
+ */
+static int lbs_memory( lua_State *L )
+{
+    if ( !lua_isnoneornil( L,1 ) )
+    {
+        int backend = luaL_checkoption( L,1,NULL,mem_backend_name );
+
+        const struct lbs_engine *engine = engine_get( L );
+        if ( !engine ) return luaL_error( L,"lua_bson not opened" );
+        if ( mem_lua_owner && mem_lua_owner != engine )
+        {
+            return luaL_error( L,
+                "memory backend is owned by another lua state" );
+        }
+
+        if ( backend != mem_backend )
+        {
+            if ( mem_holders > 0
+                || __atomic_load_n( &mem_live,__ATOMIC_RELAXED ) > 0 )
+            {
+                return luaL_error( L,
+                    "can not change memory backend while memory in use" );
+            }
+
+            if ( MEM_LUA == mem_backend ) mem_lua_close();
+            if ( MEM_LUA == backend )
+            {
+                mem_lua_thread = pthread_self();
+                mem_lua_owner  = engine;
+                mem_lua_alloc  = lua_getallocf( L,&mem_lua_ud );
+            }
+            if ( MEM_POOL == mem_backend ) pool_trim();
+
+            mem_backend = backend;
+            mem_update_vtable();
+        }
+    }
+
+    lua_pushstring( L,mem_backend_name[mem_backend] );
+    return 1;
+}
+
+/* the engine closed,release the lua backend if it's the owner.lua blocks
+ * still alive are leaked when freed,and new blocks are from pool as they
+ * need a header too
+ */
+static void mem_engine_close( const struct lbs_engine *engine )
+{
+    if ( engine != mem_lua_owner ) return;
+
+    mem_lua_close();
+    mem_backend = __atomic_load_n( &mem_live,__ATOMIC_RELAXED ) > 0 ?
+        MEM_POOL : MEM_SYSTEM;
+    mem_update_vtable();
+}
+
+/* enable_stats( on ) */
+static int lbs_enable_stats( lua_State *L )
+{
+    stats_enabled = lua_toboolean( L,1 );
+    mem_update_vtable();
+
+    return 0;
+}
+
+/* ==============================STATISTICS================================= */
+
+static const char *stats_op_name[STATS_OP_MAX] =
+{
+    "encode","decode","encode_stack","decode_stack"
+};
+
+static const char *stats_error_name[LBS_ERROR_MAX] =
+{
+    "unknown","type","depth","utf8","size","memory","bson","cycle"
+};
+
+/* stats = stats() */
+static int lbs_stats( lua_State *L )
+{
+    lua_createtable( L,0,STATS_OP_MAX + 3 );
+
+    lua_pushboolean( L,stats_enabled );
+    lua_setfield( L,-2,"enabled" );
+
+    for ( int i = 0;i < STATS_OP_MAX;i ++ )
+    {
+        const struct stats_op *so = stats.op + i;
+
+        lua_createtable( L,0,5 );
+        lua_pushinteger( L,so->calls );
+        lua_setfield( L,-2,"calls" );
+        lua_pushinteger( L,so->errors );
+        lua_setfield( L,-2,"errors" );
+
+        lua_createtable( L,0,LBS_ERROR_MAX );
+        for ( int k = 0;k < LBS_ERROR_MAX;k ++ )
+        {
+            lua_pushinteger( L,so->errors_by_kind[k] );
+            lua_setfield( L,-2,stats_error_name[k] );
+        }
+        lua_setfield( L,-2,"errors_by_kind" );
+
+        lua_pushinteger( L,so->bytes );
+        lua_setfield( L,-2,"bytes" );
+        lua_pushnumber( L,so->time );
+        lua_setfield( L,-2,"time" );
+
+        lua_setfield( L,-2,stats_op_name[i] );
+    }
+
+    lua_createtable( L,STATS_MAX_DEPTH,0 );
+    for ( int i = 0;i < STATS_MAX_DEPTH;i ++ )
+    {
+        lua_pushinteger( L,stats.depth[i] );
+        lua_rawseti( L,-2,i + 1 );
+    }
+    lua_setfield( L,-2,"depth" );
+
+    lua_createtable( L,0,4 );
+    lua_pushinteger( L,__atomic_load_n( &stats.pool_reuse,__ATOMIC_RELAXED ) );
+    lua_setfield( L,-2,"reuse" );
+    lua_pushinteger( L,__atomic_load_n( &stats.alloc_count,__ATOMIC_RELAXED ) );
+    lua_setfield( L,-2,"count" );
+    lua_pushinteger( L,__atomic_load_n( &stats.alloc_bytes,__ATOMIC_RELAXED ) );
+    lua_setfield( L,-2,"bytes" );
+    lua_pushinteger( L,__atomic_load_n( &stats.free_count,__ATOMIC_RELAXED ) );
+    lua_setfield( L,-2,"free" );
+    lua_setfield( L,-2,"alloc" );
+
+    return 1;
+}
+
+/* reset_stats() */
+static int lbs_reset_stats( lua_State *L )
+{
+    (void)L;
+    memset( &stats,0,sizeof(stats) );
+
+    return 0;
+}
+
+/* =============================BATCH DECODE================================ */
+
+/* decode a concatenated bson stream on worker threads.the stream is split
+ * into chunks of documents,each worker validate and parse a chunk into a
+ * pre-order node array without lua state.then lua thread build tables from
+ * the nodes.strings and keys point into the buffer,no copy.
+ * workers allocate with system malloc,lua allocator is not thread safe.
+ * workers are kept in a pool of the engine,started at the first call and
+ * joined when the state closed
+ */
+#define LBS_BATCH "lua_bson.batch"
+
+#define BATCH_MAX_THREAD 64
+#define BATCH_MIN_BYTES  65536 /* smaller stream is parsed in lua thread */
+
+struct batch_node
+{
+    const char *key;   /* NULL for a root document */
+    uint32_t key_len;
+    uint32_t type;     /* bson_type_t */
+    union
+    {
+        double d;
+        int64_t i;
+        int b;
+        uint32_t count; /* document and array,number of children */
+        uint32_t iter;  /* other types,index of iters */
+        struct
+        {
+            const char *ptr;
+            uint32_t len;
+        } str;
+    } v;
+};
+
+/* a document in progress of batch_parse */
+struct batch_frame
+{
+    bson_iter_t iter;
+    size_t at;         /* node of this document */
+    uint32_t count;    /* elements parsed */
+};
+
+/* a table in progress of batch_build */
+struct batch_build_frame
+{
+    uint32_t left;     /* children not built yet */
+    int array;
+    int index;         /* running index of array_key_index */
+    lua_Integer key;   /* lua index of the sub document in progress */
+};
+
+struct batch_doc
+{
+    const uint8_t *data;
+    uint32_t len;
+};
+
+struct batch_chunk
+{
+    struct batch_chunk *next; /* next chunk in pool queue */
+
+    struct lbs_batch *batch;
+    int first;         /* documents of this chunk,[first,last) */
+    int last;
+    int error;         /* index of the first invalid document,-1 if none */
+    int deep;          /* the invalid document is too deep */
+
+    struct batch_node *nodes;
+    size_t count;
+    size_t size;
+
+    /* bson types not in node are decoded by value_decode from a iter */
+    bson_iter_t *iters;
+    uint32_t iter_count;
+    uint32_t iter_size;
+
+    struct batch_frame *frames;
+    int frame_size;
+};
+
+struct lbs_batch
+{
+    struct batch_doc *docs;
+    int doc_count;
+    int max_depth;     /* engine max_depth,workers can't read lua state */
+
+    struct batch_chunk *chunks;
+    int chunk_count;
+};
+
+struct batch_pool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work;      /* a chunk is queued,or pool is stopping */
+    pthread_cond_t done;      /* all chunks are parsed */
+
+    struct batch_chunk *head; /* queued chunks */
+    struct batch_chunk *tail;
+    int pending;              /* chunks queued or being parsed */
+    int stop;
+
+    pthread_t threads[BATCH_MAX_THREAD];
+    int thread_count;
+};
+
+static struct batch_node *batch_node_new( struct batch_chunk *chunk )
+{
+    if ( chunk->count >= chunk->size )
+    {
+        size_t size = chunk->size ? chunk->size * 2 : 1024;
+        void *nodes = realloc( chunk->nodes,size * sizeof(struct batch_node) );
+        if ( !nodes ) return NULL;
+
+        chunk->nodes = (struct batch_node *)nodes;
+        chunk->size  = size;
+    }
+
+    return chunk->nodes + chunk->count++;
+}
+
+static int batch_iter_new( struct batch_chunk *chunk,const bson_iter_t *iter )
+{
+    if ( chunk->iter_count >= chunk->iter_size )
+    {
+        uint32_t size = chunk->iter_size ? chunk->iter_size * 2 : 64;
+        void *iters = realloc( chunk->iters,size * sizeof(bson_iter_t) );
+        if ( !iters ) return -1;
+
+        chunk->iters = (bson_iter_t *)iters;
+        chunk->iter_size = size;
+    }
+
+    chunk->iters[chunk->iter_count] = *iter;
+    return (int)chunk->iter_count++;
+}
+
+/* begin a frame for the document of iter,NULL if out of memory */
+static struct batch_frame *batch_frame_push( struct batch_chunk *chunk,
+    int top,const bson_iter_t *iter,size_t at )
+{
+    if ( top >= chunk->frame_size )
+    {
+        int size = chunk->frame_size ? chunk->frame_size * 2 : FRAME_CHUNK;
+        void *frames = realloc( chunk->frames,size * sizeof(struct batch_frame) );
+        if ( !frames ) return NULL;
+
+        chunk->frames = (struct batch_frame *)frames;
+        chunk->frame_size = size;
+    }
+
+    struct batch_frame *frame = chunk->frames + top;
+    frame->iter  = *iter;
+    frame->at    = at;
+    frame->count = 0;
+
+    return frame;
+}
+
+/* parse the elements of iter into nodes after the document node at,sub
+ * documents are frames instead of recursion.return -1 if the document is
+ * invalid or too deep
+ */
+static int batch_parse( struct batch_chunk *chunk,
+    const bson_iter_t *iter,size_t at )
+{
+    int max_depth = chunk->batch->max_depth;
+
+    int top = 0;
+    struct batch_frame *frame = batch_frame_push( chunk,top,iter,at );
+    if ( !frame ) return -1;
+
+    ++top;
+    for ( ;; )
+    {
+        bson_iter_t *it = &frame->iter;
+        if ( !bson_iter_next( it ) )
+        {
+            /* bson_iter_next stop at a corrupt element too */
+            if ( it->err_off ) return -1;
+
+            chunk->nodes[frame->at].v.count = frame->count;
+            if ( 0 == --top ) return 0;
+
+            frame = chunk->frames + top - 1;
+            continue;
+        }
+
+        struct batch_node *node = batch_node_new( chunk );
+        if ( !node ) return -1;
+
+        ++frame->count;
+        node->key     = bson_iter_key( it );
+        node->key_len = bson_iter_key_len( it );
+        node->type    = bson_iter_type( it );
+        switch ( node->type )
+        {
+            case BSON_TYPE_DOUBLE :
+                node->v.d = bson_iter_double( it );break;
+            case BSON_TYPE_UTF8 :
+                node->v.str.ptr = bson_iter_utf8( it,&node->v.str.len );break;
+            case BSON_TYPE_BINARY :
+            {
+                const uint8_t *ptr = NULL;
+                bson_iter_binary( it,NULL,&node->v.str.len,&ptr );
+                node->v.str.ptr = (const char *)ptr;
+            }break;
+            case BSON_TYPE_BOOL :
+                node->v.b = bson_iter_bool( it );break;
+            case BSON_TYPE_NULL : break;
+            case BSON_TYPE_INT32 :
+                node->v.i = bson_iter_int32( it );break;
+            case BSON_TYPE_INT64 :
+                node->v.i = bson_iter_int64( it );break;
+            case BSON_TYPE_DATE_TIME :
+                node->v.i = bson_iter_date_time( it );break;
+            case BSON_TYPE_DOCUMENT :
+            case BSON_TYPE_ARRAY :
+            {
+                if ( top >= max_depth )
+                {
+                    chunk->deep = 1;
+                    return -1;
+                }
+
+                bson_iter_t sub_iter;
+                if ( !bson_iter_recurse( it,&sub_iter ) ) return -1;
+
+                /* count is set when the sub document is done */
+                frame = batch_frame_push( chunk,top,&sub_iter,chunk->count - 1 );
+                if ( !frame ) return -1;
+
+                ++top;
+            }break;
+            default :
+            {
+                int index = batch_iter_new( chunk,it );
+                if ( index < 0 ) return -1;
+
+                node->v.iter = (uint32_t)index;
+            }break;
+        }
+    }
+}
+
+static void batch_worker( struct batch_chunk *chunk )
+{
+    const struct batch_doc *docs = chunk->batch->docs;
+
+    for ( int i = chunk->first;i < chunk->last;i ++ )
+    {
+        bson_t doc;
+        bson_iter_t iter;
+
+        size_t at = chunk->count;
+        struct batch_node *root = batch_node_new( chunk );
+        if ( !root
+            || !bson_init_static( &doc,docs[i].data,docs[i].len )
+            || !bson_iter_init( &iter,&doc ) )
+        {
+            chunk->error = i;
+            break;
+        }
+
+        root->key = NULL;
+        root->key_len = 0;
+        root->type = BSON_TYPE_DOCUMENT;
+
+        if ( batch_parse( chunk,&iter,at ) < 0 )
+        {
+            chunk->error = i;
+            break;
+        }
+    }
+}
+
+/* pop a queued chunk,must hold the mutex */
+static struct batch_chunk *batch_pool_pop( struct batch_pool *pool )
+{
+    struct batch_chunk *chunk = pool->head;
+    if ( chunk )
+    {
+        pool->head = chunk->next;
+        if ( !pool->head ) pool->tail = NULL;
+    }
+
+    return chunk;
+}
+
+static void *batch_pool_run( void *ud )
+{
+    struct batch_pool *pool = (struct batch_pool *)ud;
+
+    pthread_mutex_lock( &pool->mutex );
+    for ( ;; )
+    {
+        struct batch_chunk *chunk = batch_pool_pop( pool );
+        if ( !chunk )
+        {
+            if ( pool->stop ) break;
+
+            pthread_cond_wait( &pool->work,&pool->mutex );
+            continue;
+        }
+        pthread_mutex_unlock( &pool->mutex );
+
+        batch_worker( chunk );
+
+        pthread_mutex_lock( &pool->mutex );
+        if ( 0 == --pool->pending ) pthread_cond_signal( &pool->done );
+    }
+    pthread_mutex_unlock( &pool->mutex );
+
+    return NULL;
+}
+
+/* pool of engine,NULL if out of memory */
+static struct batch_pool *batch_pool_get( struct lbs_engine *engine )
+{
+    if ( engine->pool ) return engine->pool;
+
+    struct batch_pool *pool =
+        (struct batch_pool *)calloc( 1,sizeof(struct batch_pool) );
+    if ( !pool ) return NULL;
+
+    pthread_mutex_init( &pool->mutex,NULL );
+    pthread_cond_init( &pool->work,NULL );
+    pthread_cond_init( &pool->done,NULL );
+
+    engine->pool = pool;
+    return pool;
+}
+
+/* start workers until there are count of them,a failed start is ignored
+ * as lua thread parse the queued chunks too
+ */
+static void batch_pool_grow( struct batch_pool *pool,int count )
+{
+    while ( pool->thread_count < count )
+    {
+        pthread_t *thread = pool->threads + pool->thread_count;
+        if ( 0 != pthread_create( thread,NULL,batch_pool_run,pool ) ) return;
+
+        ++pool->thread_count;
+    }
+}
+
+static void batch_pool_stop( struct batch_pool *pool )
+{
+    pthread_mutex_lock( &pool->mutex );
+    pool->stop = 1;
+    pthread_cond_broadcast( &pool->work );
+    pthread_mutex_unlock( &pool->mutex );
+
+    for ( int i = 0;i < pool->thread_count;i ++ )
+    {
+        pthread_join( pool->threads[i],NULL );
+    }
+
+    pthread_cond_destroy( &pool->done );
+    pthread_cond_destroy( &pool->work );
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool );
+}
+
+/* parse all chunks of batch,with the pool if any.lua thread parse the last
+ * chunk and then help with the queued ones,return when all are done
+ */
+static void batch_pool_run_batch( struct batch_pool *pool,
+    struct lbs_batch *batch )
+{
+    int last = batch->chunk_count - 1;
+    if ( !pool || last < 1 )
+    {
+        for ( int i = 0;i <= last;i ++ ) batch_worker( batch->chunks + i );
+        return;
+    }
+
+    batch_pool_grow( pool,last );
+
+    pthread_mutex_lock( &pool->mutex );
+    for ( int i = 0;i < last;i ++ )
+    {
+        struct batch_chunk *chunk = batch->chunks + i;
+        chunk->next = NULL;
+        if ( pool->tail )
+            pool->tail->next = chunk;
+        else
+            pool->head = chunk;
+        pool->tail = chunk;
+    }
+    pool->pending += last;
+    pthread_cond_broadcast( &pool->work );
+    pthread_mutex_unlock( &pool->mutex );
+
+    batch_worker( batch->chunks + last );
+
+    pthread_mutex_lock( &pool->mutex );
+    for ( ;; )
+    {
+        struct batch_chunk *chunk = batch_pool_pop( pool );
+        if ( !chunk ) break;
+
+        pthread_mutex_unlock( &pool->mutex );
+        batch_worker( chunk );
+        pthread_mutex_lock( &pool->mutex );
+
+        --pool->pending;
+    }
+    while ( pool->pending > 0 ) pthread_cond_wait( &pool->done,&pool->mutex );
+    pthread_mutex_unlock( &pool->mutex );
+}
+
+static int batch_gc( lua_State *L )
+{
+    struct lbs_batch *batch = (struct lbs_batch *)lua_touserdata( L,1 );
+
+    for ( int i = 0;i < batch->chunk_count;i ++ )
+    {
+        struct batch_chunk *chunk = batch->chunks + i;
+
+        free( chunk->nodes );
+        free( chunk->iters );
+        free( chunk->frames );
+    }
+    free( batch->chunks );
+    free( batch->docs );
+    memset( batch,0,sizeof(struct lbs_batch) );
+
+    return 0;
+}
+
+/* begin a frame for the document or array node at pos,push a table for
+ * it and move pos to the first child
+ */
+static struct batch_build_frame *batch_build_push( lua_State *L,
+    struct batch_chunk *chunk,size_t *pos,struct frame_stack *stack,
+    int top,struct decode_ctx *ctx )
+{
+    /* table and key of every frame,and value and a copy of key for key
+     * cache
+     */
+    if ( 0 == top % STACK_CHUNK && !lua_checkstack( L,STACK_CHUNK * 2 + 4 ) )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"bson_decode stack overflow" );
+        return NULL;
+    }
+
+    struct batch_build_frame *frame = (struct batch_build_frame *)
+        frame_at( stack,top,sizeof(struct batch_build_frame) );
+    if ( !frame )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+        return NULL;
+    }
+
+    const struct batch_node *node = chunk->nodes + (*pos)++;
+    frame->left  = node->v.count;
+    frame->array = BSON_TYPE_ARRAY == node->type;
+    frame->index = 0;
+
+    if ( frame->array )
+    {
+        lua_createtable( L,(int)node->v.count,0 );
+    }
+    else
+    {
+        lua_createtable( L,0,(int)node->v.count );
+    }
+
+    return frame;
+}
+
+/* build a table from the document node at pos and move pos to the next
+ * document.sub documents are frames instead of recursion
+ */
+static int batch_build( lua_State *L,struct batch_chunk *chunk,
+    size_t *pos,struct frame_stack *stack,struct decode_ctx *ctx )
+{
+    int base = lua_gettop( L );
+
+    int top = 0;
+    struct batch_build_frame *frame =
+        batch_build_push( L,chunk,pos,stack,top,ctx );
+    if ( !frame ) goto error;
+
+    ++top;
+    for ( ;; )
+    {
+        if ( 0 == frame->left )
+        {
+            if ( 0 == --top ) break;
+
+            /* the table is the value of parent's element */
+            frame = (struct batch_build_frame *)
+                frame_at( stack,top - 1,sizeof(struct batch_build_frame) );
+            if ( frame->array )
+                lua_rawseti( L,-2,frame->key );
+            else
+                lua_rawset( L,-3 );
+            continue;
+        }
+
+        --frame->left;
+        const struct batch_node *node = chunk->nodes + *pos;
+        if ( frame->array )
+        {
+            frame->key = array_key_index( node->key,node->key_len,&frame->index );
+        }
+        else
+        {
+            push_key( L,node->key,(int)node->key_len,ctx );
+        }
+
+        switch ( node->type )
+        {
+            case BSON_TYPE_DOUBLE :
+                lua_pushnumber( L,node->v.d );break;
+            case BSON_TYPE_UTF8 :
+            case BSON_TYPE_BINARY :
+                lua_pushlstring( L,node->v.str.ptr,node->v.str.len );break;
+            case BSON_TYPE_BOOL :
+                lua_pushboolean( L,node->v.b );break;
+            case BSON_TYPE_NULL :
+                lua_pushnil( L );break;
+            case BSON_TYPE_INT32 :
+            case BSON_TYPE_INT64 :
+            case BSON_TYPE_DATE_TIME :
+                lua_pushinteger( L,node->v.i );break;
+            case BSON_TYPE_DOCUMENT :
+            case BSON_TYPE_ARRAY :
+            {
+                frame = batch_build_push( L,chunk,pos,stack,top,ctx );
+                if ( !frame ) goto error;
+
+                ++top;
+            }continue;
+            default :
+            {
+                if ( value_decode( L,chunk->iters + node->v.iter,ctx ) < 0 )
+                {
+                    goto error;
+                }
+            }break;
+        }
+
+        ++(*pos);
+        if ( frame->array )
+            lua_rawseti( L,-2,frame->key );
+        else
+            lua_rawset( L,-3 );
+    }
+
+    return 0;
+
+error:
+    lua_settop( L,base );
+    return -1;
+}
+
+/* split buffer into documents */
+static int batch_split( struct lbs_batch *batch,
+    const uint8_t *data,size_t size,struct error_collector *ec )
+{
+    int doc_size = 0;
+    size_t pos = 0;
+    while ( pos < size )
+    {
+        uint32_t len_le = 0;
+        if ( size - pos < 5 )
+        {
+            ERROR_LOG( ec,LBS_ERROR_BSON,"truncated bson document at %zu",pos );
+            return -1;
+        }
+
+        memcpy( &len_le,data + pos,sizeof(len_le) );
+        size_t len = BSON_UINT32_FROM_LE( len_le );
+        if ( len < 5 || len > size - pos || data[pos + len - 1] != 0 )
+        {
+            ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson document at %zu",pos );
+            return -1;
+        }
+
+        if ( batch->doc_count >= doc_size )
+        {
+            doc_size = doc_size ? doc_size * 2 : 64;
+            void *docs = realloc( batch->docs,doc_size * sizeof(struct batch_doc) );
+            if ( !docs )
+            {
+                ERROR_LOG( ec,LBS_ERROR_MEMORY,"out of memory" );
+                return -1;
+            }
+            batch->docs = (struct batch_doc *)docs;
+        }
+
+        batch->docs[batch->doc_count].data = data + pos;
+        batch->docs[batch->doc_count].len  = (uint32_t)len;
+        ++batch->doc_count;
+
+        pos += len;
+    }
+
+    return 0;
+}
+
+/* split documents into chunks of about the same bytes */
+static int batch_partition( struct lbs_batch *batch,
+    int threads,size_t size,struct error_collector *ec )
+{
+    if ( size < BATCH_MIN_BYTES ) threads = 1;
+    if ( threads > batch->doc_count ) threads = batch->doc_count;
+    if ( threads < 1 ) threads = 1;
+
+    batch->chunks = (struct batch_chunk *)
+        calloc( threads,sizeof(struct batch_chunk) );
+    if ( !batch->chunks )
+    {
+        ERROR_LOG( ec,LBS_ERROR_MEMORY,"out of memory" );
+        return -1;
+    }
+    batch->chunk_count = threads;
+
+    int doc = 0;
+    size_t bytes = 0;
+    for ( int i = 0;i < threads;i ++ )
+    {
+        struct batch_chunk *chunk = batch->chunks + i;
+        chunk->batch = batch;
+        chunk->error = -1;
+        chunk->first = doc;
+
+        size_t target = size / threads * ( i + 1 );
+        while ( doc < batch->doc_count
+            && ( bytes < target || i == threads - 1 ) )
+        {
+            bytes += batch->docs[doc++].len;
+        }
+        chunk->last = doc;
+    }
+
+    return 0;
+}
+
+static int decode_batch( lua_State *L,
+    int threads,struct error_collector *ec )
+{
+    size_t size = 0;
+    const uint8_t *data = (const uint8_t *)luaL_checklstring( L,1,&size );
+
+    struct lbs_batch *batch = (struct lbs_batch *)
+        lua_newuserdata( L,sizeof(struct lbs_batch) );
+    memset( batch,0,sizeof(struct lbs_batch) );
+    luaL_setmetatable( L,LBS_BATCH );
+    int batch_index = lua_gettop( L );
+
+    if ( batch_split( batch,data,size,ec ) < 0
+        || batch_partition( batch,threads,size,ec ) < 0 )
+    {
+        return -1;
+    }
+
+    struct lbs_engine *engine = engine_get( L );
+    batch->max_depth = engine_max_depth( L );
+    batch_pool_run_batch( engine ? batch_pool_get( engine ) : NULL,batch );
+
+    for ( int i = 0;i < batch->chunk_count;i ++ )
+    {
+        const struct batch_chunk *chunk = batch->chunks + i;
+        if ( chunk->error >= 0 && chunk->deep )
+        {
+            ERROR_LOG( ec,LBS_ERROR_DEPTH,
+                "bson document #%d too deep,max depth is %d",
+                chunk->error + 1,batch->max_depth );
+            return -1;
+        }
+        if ( chunk->error >= 0 )
+        {
+            ERROR_LOG( ec,LBS_ERROR_BSON,
+                "invalid bson document #%d",chunk->error + 1 );
+            return -1;
+        }
+    }
+
+    lua_createtable( L,batch->doc_count,0 );
+    int result = lua_gettop( L );
+
+    struct decode_ctx ctx;
+    decode_ctx_init( L,&ctx,ec );
+
+    int max_depth = 0;
+    struct frame_stack tmp;
+    struct frame_stack *stack = frame_stack_acquire( L,1,&tmp,&max_depth );
+
+    int index = 0;
+    for ( int i = 0;i < batch->chunk_count;i ++ )
+    {
+        size_t pos = 0;
+        struct batch_chunk *chunk = batch->chunks + i;
+        while ( pos < chunk->count )
+        {
+            if ( batch_build( L,chunk,&pos,stack,&ctx ) < 0 )
+            {
+                frame_stack_release( stack,&tmp );
+                return -1;
+            }
+            lua_rawseti( L,result,++index );
+        }
+    }
+    frame_stack_release( stack,&tmp );
+    decode_ctx_done( L,&ctx );
+
+    /* release nodes now instead of waiting for gc */
+    lua_pushcfunction( L,batch_gc );
+    lua_pushvalue( L,batch_index );
+    lua_call( L,1,0 );
+
+    return 0;
+}
+
+/* array,error = decode_batch( buffer,nothrow,threads ),threads default to
+ * the number of cpu cores,at most BATCH_MAX_THREAD
+ */
+static int lbs_decode_batch( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    int nothrow = lua_toboolean( L,2 );
+
+    lua_Integer threads = 0;
+    if ( lua_isnoneornil( L,3 ) )
+    {
+        long cores = sysconf( _SC_NPROCESSORS_ONLN );
+        threads = cores < 1 ? 1 : ( cores > BATCH_MAX_THREAD ?
+            BATCH_MAX_THREAD : cores );
+    }
+    else
+    {
+        threads = luaL_checkinteger( L,3 );
+        luaL_argcheck( L,threads >= 1 && threads <= BATCH_MAX_THREAD,3,
+            "invalid threads count" );
+    }
+
+    lua_settop( L,3 );
+    if ( decode_batch( L,(int)threads,&ec ) >= 0 ) return 1;
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+static const luaL_Reg batch_lib[] =
+{
+    {"__gc",batch_gc},
+    {NULL,NULL}
+};
+
+/* =============================ASYNC ENCODE================================ */
+
+/* encode a batch of tables in background.lua thread snapshot the tables
+ * into a node array,with keys and strings copied into a arena,so the
+ * tables can be changed or collected at once.worker threads serialize the
+ * nodes into bson and optionally write them into a file.
+ * workers allocate with system realloc,bson writers are created and
+ * destroyed in lua thread,so any memory backend is safe
+ */
+#define LBS_ASYNC "lua_bson.async"
+
+#define ASYNC_MAX_THREAD 64
+
+struct snap_node
+{
+    uint32_t type;     /* bson_type_t */
+    uint32_t key_len;  /* object key only,array key is the element index */
+    size_t key;        /* offset in arena */
+    union
+    {
+        double d;
+        int64_t i;
+        int b;
+        uint32_t count; /* document and array,number of children */
+        uint32_t value; /* typed value,index of values */
+        struct
+        {
+            size_t off;
+            uint32_t len;
+        } str;
+    } v;
+};
+
+struct async_part
+{
+    pthread_t thread;
+    int started;
+
+    struct lbs_async *job;
+    int first;          /* root documents of this part,[first,last) */
+    int last;
+
+    bson_writer_t *writer;
+    uint8_t *buffer;
+    size_t size;
+    size_t length;
+    int error;          /* index of the first failed root,-1 if none */
+    char what[LBS_MAX_ERROR_MSG]; /* why the root failed */
+};
+
+struct lbs_async
+{
+    struct snap_node *nodes;
+    size_t count;
+    size_t size;
+
+    char *arena;
+    size_t arena_len;
+    size_t arena_size;
+
+    bson_value_t *values; /* copies of typed values */
+    uint32_t value_count;
+    uint32_t value_size;
+
+    size_t *roots;      /* node index of each root document */
+    int root_count;
+
+    struct async_part *parts;
+    int part_count;
+
+    char *path;         /* write into this file if not NULL */
+    char what[LBS_MAX_ERROR_MSG];
+    int max_depth;      /* engine max_depth when snapshot */
+
+    pthread_t thread;
+    int started;
+    int joined;
+    int done;           /* set by worker,read with atomic */
+};
+
+static struct snap_node *snap_node_new( struct lbs_async *job,
+    uint32_t type,const char *key,int key_len,struct encode_ctx *ctx );
+
+static size_t snap_arena( struct lbs_async *job,const char *str,size_t len )
+{
+    if ( job->arena_len + len > job->arena_size )
+    {
+        size_t size = job->arena_size ? job->arena_size : 4096;
+        while ( size < job->arena_len + len ) size *= 2;
+
+        char *arena = (char *)realloc( job->arena,size );
+        if ( !arena ) return (size_t)-1;
+
+        job->arena = arena;
+        job->arena_size = size;
+    }
+
+    size_t off = job->arena_len;
+    memcpy( job->arena + off,str,len );
+    job->arena_len += len;
+
+    return off;
+}
+
+static struct snap_node *snap_node_new( struct lbs_async *job,
+    uint32_t type,const char *key,int key_len,struct encode_ctx *ctx )
+{
+    if ( job->count >= job->size )
+    {
+        size_t size = job->size ? job->size * 2 : 1024;
+        void *nodes = realloc( job->nodes,size * sizeof(struct snap_node) );
+        if ( !nodes )
+        {
+            ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+            return NULL;
+        }
+
+        job->nodes = (struct snap_node *)nodes;
+        job->size  = size;
+    }
+
+    struct snap_node *node = job->nodes + job->count;
+    node->type = type;
+    node->key_len = 0;
+    node->key = 0;
+    if ( key )
+    {
+        if ( (size_t)-1 == ( node->key = snap_arena( job,key,key_len ) ) )
+        {
+            ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+            return NULL;
+        }
+        node->key_len = (uint32_t)key_len;
+    }
+
+    ++job->count;
+    return node;
+}
+
+static int snap_table( lua_State *L,
+    struct lbs_async *job,int index,size_t at,struct encode_ctx *ctx );
+
+/* snapshot the value at index as value_encode do,key is NULL for a array
+ * element
+ */
+static int snap_value( lua_State *L,struct lbs_async *job,
+    const char *key,int key_len,int index,struct encode_ctx *ctx )
+{
+    struct snap_node *node = NULL;
+    int ty = lua_type( L,index );
+    switch ( ty )
+    {
+        case LUA_TNIL :
+        {
+            node = snap_node_new( job,BSON_TYPE_NULL,key,key_len,ctx );
+        }break;
+        case LUA_TBOOLEAN :
+        {
+            node = snap_node_new( job,BSON_TYPE_BOOL,key,key_len,ctx );
+            if ( node ) node->v.b = lua_toboolean( L,index );
+        }break;
+        case LUA_TNUMBER :
+        {
+            if ( lua_isinteger( L,index ) )
+            {
+                lua_Integer val = lua_tointeger( L,index );
+                node = snap_node_new( job,lua_isbit32( val ) ?
+                    BSON_TYPE_INT32 : BSON_TYPE_INT64,key,key_len,ctx );
+                if ( node ) node->v.i = val;
+            }
+            else
+            {
+                node = snap_node_new( job,BSON_TYPE_DOUBLE,key,key_len,ctx );
+                if ( node ) node->v.d = lua_tonumber( L,index );
+            }
+        }break;
+        case LUA_TSTRING :
+        {
+            size_t len = 0;
+            const char *val = lua_tolstring( L,index,&len );
+            node = snap_node_new( job,BSON_TYPE_UTF8,key,key_len,ctx );
+            if ( !node ) return -1;
+
+            node->v.str.len = (uint32_t)len;
+            if ( (size_t)-1 == ( node->v.str.off = snap_arena( job,val,len ) ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+                return -1;
+            }
+        }break;
+        case LUA_TTABLE :
+        {
+            if ( lua_gettop( L ) > MAX_LUA_STACK || !lua_checkstack( L,2 ) )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"stack overflow" );
+                return -1;
+            }
+
+            node = snap_node_new( job,BSON_TYPE_DOCUMENT,key,key_len,ctx );
+            if ( !node ) return -1;
+
+            return snap_table( L,job,index,job->count - 1,ctx );
+        }break;
+        case LUA_TUSERDATA :
+        {
+            const bson_value_t *val =
+                (const bson_value_t *)luaL_testudata( L,index,LBS_VALUE );
+            if ( !val )
+            {
+                ERROR_LOG( ctx->ec,LBS_ERROR_TYPE,
+                    "value_encode can not convert %s to bson value\n",
+                    lua_typename(L,ty) );
+                return -1;
+            }
+
+            if ( job->value_count >= job->value_size )
+            {
+                uint32_t size = job->value_size ? job->value_size * 2 : 16;
+                void *values = realloc( job->values,size * sizeof(bson_value_t) );
+                if ( !values )
+                {
+                    ERROR_LOG( ctx->ec,LBS_ERROR_MEMORY,"out of memory" );
+                    return -1;
+                }
+                job->values = (bson_value_t *)values;
+                job->value_size = size;
+            }
+
+            node = snap_node_new( job,val->value_type,key,key_len,ctx );
+            if ( !node ) return -1;
+
+            /* copy on lua thread,workers only read it.the copies hold
+             * libbson memory until the job collected
+             */
+            if ( 0 == job->value_count ) MEM_HOLD();
+            node->v.value = job->value_count;
+            bson_value_copy( val,job->values + job->value_count++ );
+        }break;
+        default :
+        {
+            ERROR_LOG( ctx->ec,LBS_ERROR_TYPE,
+                "value_encode can not convert %s to bson value\n",
+                lua_typename(L,ty) );
+            return -1;
+        }break;
+    }
+
+    return node ? 0 : -1;
+}
+
+/* snapshot the table at index into children of node at,classify it as
+ * table_encode do
+ */
+static int snap_table( lua_State *L,
+    struct lbs_async *job,int index,size_t at,struct encode_ctx *ctx )
+{
+    int array = 0;
+    int max_index = -1;
+    uint32_t count = 0;
+    int stack_top = lua_gettop( L );
+
+    if ( ctx->depth >= job->max_depth )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,
+            "table too deep,max depth is %d",job->max_depth );
+        return -1;
+    }
+    if ( ++ctx->depth > ctx->max_depth ) ctx->max_depth = ctx->depth;
+
+    if ( index < 0 ) index = stack_top + index + 1;
+    is_array( L,index,array_metafield( L,index,ctx ),&array,&max_index );
+
+    if ( array && max_index > 0 )
+    {
+        /* a sparse array like { [10] = "foo" },missing ones are null */
+        for ( int i = 1;i <= max_index;i ++ )
+        {
+            lua_rawgeti( L,index,i );
+            if ( snap_value( L,job,NULL,0,stack_top + 1,ctx ) < 0 ) return -1;
+            lua_pop( L,1 );
+        }
+        count = (uint32_t)max_index;
+    }
+    else
+    {
+        lua_pushnil( L );
+        while ( lua_next( L,index ) != 0 )
+        {
+            char key[MAX_KEY_LENGTH] = { 0 };
+            const char *pkey = NULL;
+            int key_len = 0;
+            if ( !array )
+            {
+                switch ( lua_type( L,-2 ) )
+                {
+                    case LUA_TBOOLEAN :
+                    {
+                        pkey = lua_toboolean( L,-2 ) ? "true" : "false";
+                        key_len = (int)strlen( pkey );
+                    }break;
+                    case LUA_TNUMBER :
+                    {
+                        if ( lua_isinteger( L,-2 ) )
+                            key_len = fast_itoa( key,lua_tointeger( L,-2 ) );
+                        else
+                            key_len = snprintf( key,MAX_KEY_LENGTH,
+                                LUA_NUMBER_FMT,lua_tonumber( L,-2 ) );
+                        pkey = key;
+                    }break;
+                    case LUA_TSTRING :
+                    {
+                        size_t len = 0;
+                        pkey = lua_tolstring( L,-2,&len );
+                        key_len = (int)len;
+                        if ( len > MAX_KEY_LENGTH - 1 )
+                        {
+                            ERROR_LOG( ctx->ec,LBS_ERROR_SIZE,
+                                "lua table string key too long\n" );
+                            return -1;
+                        }
+                    }break;
+                    default :
+                    {
+                        ERROR_LOG( ctx->ec,LBS_ERROR_TYPE,
+                            "can not convert %s to bson key\n",
+                            lua_typename( L,lua_type( L,-2 ) ) );
+                        return -1;
+                    }break;
+                }
+            }
+
+            if ( snap_value( L,job,pkey,key_len,stack_top + 2,ctx ) < 0 )
+            {
+                return -1;
+            }
+            lua_pop( L,1 );
+            ++count;
+        }
+    }
+
+    struct snap_node *node = job->nodes + at;
+    node->type    = array ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT;
+    node->v.count = count;
+
+    --ctx->depth;
+    return 0;
+}
+
+static void *async_realloc( void *mem,size_t num_bytes,void *ctx )
+{
+    (void)ctx;
+    return realloc( mem,num_bytes );
+}
+
+/* tell why appending key failed.libbson reject a key with a embedded '\0'
+ * and typed values it can't append,otherwise the document grow over
+ * BSON_MAX_SIZE
+ */
+static void async_fail( struct async_part *part,
+    const struct snap_node *child,const char *key,int key_len )
+{
+    if ( memchr( key,0,key_len ) )
+    {
+        snprintf( part->what,LBS_MAX_ERROR_MSG,
+            "invalid key %s,it contain '\\0'",key );
+    }
+    else if ( child->type <= 0xFF && value_types[child->type].name )
+    {
+        snprintf( part->what,LBS_MAX_ERROR_MSG,
+            "%s value at %s rejected by libbson or document too large",
+            value_types[child->type].name,key );
+    }
+    else
+    {
+        snprintf( part->what,LBS_MAX_ERROR_MSG,
+            "can not append %s,document too large",key );
+    }
+}
+
+/* serialize children of the node at pos into doc,move pos to next sibling */
+static int async_write( struct async_part *part,bson_t *doc,size_t *pos )
+{
+    struct lbs_async *job = part->job;
+    const struct snap_node *node = job->nodes + (*pos)++;
+    int array = BSON_TYPE_ARRAY == node->type;
+
+    char buffer[INTEGER_KEY_SIZE];
+    for ( uint32_t i = 0;i < node->v.count;i ++ )
+    {
+        const struct snap_node *child = job->nodes + *pos;
+
+        int key_len = (int)child->key_len;
+        const char *key = array ?
+            index_key( (int)i,buffer,&key_len ) : job->arena + child->key;
+
+        bool ok = true;
+        switch ( child->type )
+        {
+            case BSON_TYPE_NULL :
+                ok = bson_append_null( doc,key,key_len );break;
+            case BSON_TYPE_BOOL :
+                ok = bson_append_bool( doc,key,key_len,child->v.b );break;
+            case BSON_TYPE_INT32 :
+                ok = bson_append_int32( doc,key,key_len,(int32_t)child->v.i );break;
+            case BSON_TYPE_INT64 :
+                ok = bson_append_int64( doc,key,key_len,child->v.i );break;
+            case BSON_TYPE_DOUBLE :
+                ok = bson_append_double( doc,key,key_len,child->v.d );break;
+            case BSON_TYPE_UTF8 :
+                ok = bson_append_utf8( doc,key,key_len,
+                    job->arena + child->v.str.off,(int)child->v.str.len );break;
+            case BSON_TYPE_DOCUMENT :
+            case BSON_TYPE_ARRAY :
+            {
+                bson_t sub;
+                if ( BSON_TYPE_ARRAY == child->type )
+                    ok = bson_append_array_begin( doc,key,key_len,&sub );
+                else
+                    ok = bson_append_document_begin( doc,key,key_len,&sub );
+                if ( !ok )
+                {
+                    async_fail( part,child,key,key_len );
+                    return -1;
+                }
+
+                ok = async_write( part,&sub,pos ) >= 0;
+                if ( BSON_TYPE_ARRAY == child->type )
+                    bson_append_array_end( doc,&sub );
+                else
+                    bson_append_document_end( doc,&sub );
+                if ( !ok ) return -1;
+
+                continue; /* pos already moved */
+            }break;
+            default :
+                ok = bson_append_value(
+                    doc,key,key_len,job->values + child->v.value );break;
+        }
+
+        if ( !ok )
+        {
+            async_fail( part,child,key,key_len );
+            return -1;
+        }
+        ++(*pos);
+    }
+
+    return 0;
+}
+
+static void *async_part_run( void *ud )
+{
+    struct async_part *part = (struct async_part *)ud;
+    struct lbs_async *job = part->job;
+
+    for ( int i = part->first;i < part->last;i ++ )
+    {
+        bson_t *doc = NULL;
+        size_t pos = job->roots[i];
+        if ( !bson_writer_begin( part->writer,&doc ) )
+        {
+            part->error = i;
+            snprintf( part->what,LBS_MAX_ERROR_MSG,"out of memory" );
+            break;
+        }
+
+        if ( async_write( part,doc,&pos ) < 0 )
+        {
+            bson_writer_rollback( part->writer );
+            part->error = i;
+            break;
+        }
+        bson_writer_end( part->writer );
+    }
+
+    part->length = bson_writer_get_length( part->writer );
+    return NULL;
+}
+
+static void *async_run( void *ud )
+{
+    struct lbs_async *job = (struct lbs_async *)ud;
+
+    for ( int i = 1;i < job->part_count;i ++ )
+    {
+        struct async_part *part = job->parts + i;
+        if ( 0 == pthread_create( &part->thread,NULL,async_part_run,part ) )
+        {
+            part->started = 1;
+        }
+    }
+
+    for ( int i = 0;i < job->part_count;i ++ )
+    {
+        struct async_part *part = job->parts + i;
+        if ( part->started )
+            pthread_join( part->thread,NULL );
+        else
+            async_part_run( part );
+
+        /* parts are in order,the first error is the first failed root */
+        if ( part->error >= 0 && !job->what[0] )
+        {
+            snprintf( job->what,LBS_MAX_ERROR_MSG,
+                "bson document #%d %s",part->error + 1,part->what );
+        }
+    }
+
+    if ( job->path && !job->what[0] )
+    {
+        FILE *file = fopen( job->path,"wb" );
+        for ( int i = 0;file && i < job->part_count;i ++ )
+        {
+            struct async_part *part = job->parts + i;
+            if ( part->length != fwrite( part->buffer,1,part->length,file ) )
+            {
+                break;
+            }
+        }
+        if ( !file || ferror( file ) )
+        {
+            snprintf( job->what,LBS_MAX_ERROR_MSG,
+                "can not write %s:%s",job->path,strerror( errno ) );
+        }
+        if ( file && fclose( file ) && !job->what[0] )
+        {
+            snprintf( job->what,LBS_MAX_ERROR_MSG,
+                "can not write %s:%s",job->path,strerror( errno ) );
+        }
+    }
+
+    __atomic_store_n( &job->done,1,__ATOMIC_RELEASE );
+    return NULL;
+}
+
+static void async_join( struct lbs_async *job )
+{
+    if ( job->started && !job->joined )
+    {
+        pthread_join( job->thread,NULL );
+        job->joined = 1;
+    }
+}
+
+static int async_gc( lua_State *L )
+{
+    struct lbs_async *job = (struct lbs_async *)lua_touserdata( L,1 );
+
+    async_join( job );
+    for ( int i = 0;i < job->part_count;i ++ )
+    {
+        struct async_part *part = job->parts + i;
+        if ( part->writer ) bson_writer_destroy( part->writer );
+        free( part->buffer );
+    }
+    free( job->parts );
+    free( job->nodes );
+    free( job->arena );
+    free( job->roots );
+    for ( uint32_t i = 0;i < job->value_count;i ++ )
+    {
+        bson_value_destroy( job->values + i );
+    }
+    free( job->values );
+    if ( job->value_count ) MEM_UNHOLD();
+    free( job->path );
+    if ( job->part_count ) MEM_UNHOLD();
+
+    memset( job,0,sizeof(struct lbs_async) );
+    return 0;
+}
+
+/* done = job:done(),check without blocking */
+static int async_done( lua_State *L )
+{
+    struct lbs_async *job =
+        (struct lbs_async *)luaL_checkudata( L,1,LBS_ASYNC );
+
+    lua_pushboolean( L,__atomic_load_n( &job->done,__ATOMIC_ACQUIRE ) );
+    return 1;
+}
+
+/* job:wait(),block until done */
+static int async_wait( lua_State *L )
+{
+    struct lbs_async *job =
+        (struct lbs_async *)luaL_checkudata( L,1,LBS_ASYNC );
+
+    async_join( job );
+    return 0;
+}
+
+/* buffer,error = job:result( nothrow ),block until done.return the
+ * concatenated bson stream,or the bytes written if a file path given
+ */
+static int async_result( lua_State *L )
+{
+    struct lbs_async *job =
+        (struct lbs_async *)luaL_checkudata( L,1,LBS_ASYNC );
+    int nothrow = lua_toboolean( L,2 );
+
+    async_join( job );
+    if ( job->what[0] )
+    {
+        if ( !nothrow ) return luaL_error( L,"%s",job->what );
+
+        lua_pushnil( L );
+        lua_pushstring( L,job->what );
+        return 2;
+    }
+
+    size_t length = 0;
+    for ( int i = 0;i < job->part_count;i ++ ) length += job->parts[i].length;
+
+    if ( job->path )
+    {
+        lua_pushinteger( L,(lua_Integer)length );
+        return 1;
+    }
+
+    luaL_Buffer b;
+    char *ptr = luaL_buffinitsize( L,&b,length );
+    for ( int i = 0;i < job->part_count;i ++ )
+    {
+        memcpy( ptr,job->parts[i].buffer,job->parts[i].length );
+        ptr += job->parts[i].length;
+    }
+    luaL_pushresultsize( &b,length );
+
+    return 1;
+}
+
+/* split root documents into parts of about the same nodes */
+static int async_partition( struct lbs_async *job,int threads )
+{
+    if ( threads > job->root_count ) threads = job->root_count;
+    if ( threads < 1 ) threads = 1;
+
+    job->parts = (struct async_part *)calloc( threads,sizeof(struct async_part) );
+    if ( !job->parts ) return -1;
+    job->part_count = threads;
+
+    int root = 0;
+    for ( int i = 0;i < threads;i ++ )
+    {
+        struct async_part *part = job->parts + i;
+        part->job   = job;
+        part->first = root;
+        part->error = -1;
+
+        size_t target = job->count / threads * ( i + 1 );
+        while ( root < job->root_count
+            && ( job->roots[root] < target || i == threads - 1 ) )
+        {
+            ++root;
+        }
+        part->last = root;
+
+        /* bson_writer_new allocate by libbson vtable,do it in lua thread */
+        part->writer = bson_writer_new(
+            &part->buffer,&part->size,0,async_realloc,NULL );
+    }
+
+    return 0;
+}
+
+static int encode_async( lua_State *L,
+    struct lbs_async *job,int threads,struct error_collector *ec )
+{
+    struct encode_ctx ctx;
+    ENCODE_CTX_INIT( &ctx,ec );
+    job->max_depth = engine_max_depth( L );
+
+    int root_count = (int)lua_rawlen( L,1 );
+    job->roots = (size_t *)malloc( ( root_count + 1 ) * sizeof(size_t) );
+    if ( !job->roots )
+    {
+        ERROR_LOG( ec,LBS_ERROR_MEMORY,"out of memory" );
+        return -1;
+    }
+
+    for ( int i = 1;i <= root_count;i ++ )
+    {
+        if ( LUA_TTABLE != lua_rawgeti( L,1,i ) )
+        {
+            ERROR_LOG( ec,LBS_ERROR_TYPE,"document #%d table expected,got %s",
+                i,lua_typename( L,lua_type(L,-1) ) );
+            return -1;
+        }
+
+        size_t at = job->count;
+        if ( !snap_node_new( job,BSON_TYPE_DOCUMENT,NULL,0,&ctx )
+            || snap_table( L,job,lua_gettop( L ),at,&ctx ) < 0 )
+        {
+            return -1;
+        }
+        /* a root classified as array is still written as a document,with
+         * keys "0","1",... as lbs_do_encode do
+         */
+        job->roots[job->root_count++] = at;
+        lua_pop( L,1 );
+    }
+
+    if ( async_partition( job,threads ) < 0 )
+    {
+        ERROR_LOG( ec,LBS_ERROR_MEMORY,"out of memory" );
+        return -1;
+    }
+    MEM_HOLD();
+
+    if ( 0 != pthread_create( &job->thread,NULL,async_run,job ) )
+    {
+        /* no thread available,finish it now */
+        async_run( job );
+        return 0;
+    }
+    job->started = 1;
+
+    return 0;
+}
+
+/* job,error = encode_async( tbls,nothrow,path,threads ),tbls is a array of
+ * tables.threads default to 1
+ */
+static int lbs_encode_async( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    luaL_checktype( L,1,LUA_TTABLE );
+    int nothrow = lua_toboolean( L,2 );
+    const char *path = luaL_optstring( L,3,NULL );
+    lua_Integer threads = luaL_optinteger( L,4,1 );
+    luaL_argcheck( L,threads >= 1 && threads <= ASYNC_MAX_THREAD,4,
+        "invalid threads count" );
+
+    lua_settop( L,4 );
+    struct lbs_async *job = (struct lbs_async *)
+        lua_newuserdata( L,sizeof(struct lbs_async) );
+    memset( job,0,sizeof(struct lbs_async) );
+    luaL_setmetatable( L,LBS_ASYNC );
+
+    if ( path && !( job->path = strdup( path ) ) )
+    {
+        ERROR_LOG( (&ec),LBS_ERROR_MEMORY,"out of memory" );
+    }
+    else if ( encode_async( L,job,(int)threads,&ec ) >= 0 )
+    {
+        lua_settop( L,5 );
+        return 1;
+    }
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+static const luaL_Reg async_lib[] =
+{
+    {"done",async_done},
+    {"wait",async_wait},
+    {"result",async_result},
+    {"__gc",async_gc},
+    {NULL,NULL}
+};
+
+/* ==============================TYPED VALUE================================ */
+/* value = value( type,... ),create a typed value.type is a name in
+ * value_types
+ */
+static int lbs_value( lua_State *L )
+{
+    const char *name = luaL_checkstring( L,1 );
+
+    bson_value_t val;
+    memset( &val,0,sizeof(val) );
+    for ( int i = 0;i < 256;i ++ )
+    {
+        if ( value_types[i].name && 0 == strcmp( value_types[i].name,name ) )
         {
-            char key[MAX_KEY_LENGTH] = { 0 };
-            /* 'key' (at index -2) and 'value' (at index -1) */
-            const char *pkey = NULL;
-            switch ( lua_type( L,-2 ) )
+            val.value_type = (bson_type_t)i;
+            value_types[i].make( L,2,&val );
+            value_new( L,&val );
+
+            return 1;
+        }
+    }
+
+    return luaL_argerror( L,1,"unknow bson type" );
+}
+
+static int value_gc( lua_State *L )
+{
+    bson_value_t *val = (bson_value_t *)lua_touserdata( L,1 );
+
+    if ( VALUE_TYPE( val )->owns ) MEM_UNHOLD();
+    bson_value_destroy( val );
+    memset( val,0,sizeof(bson_value_t) );
+
+    return 0;
+}
+
+/* name = value:type() */
+static int value_typename( lua_State *L )
+{
+    const bson_value_t *val =
+        (const bson_value_t *)luaL_checkudata( L,1,LBS_VALUE );
+
+    lua_pushstring( L,VALUE_TYPE( val )->name );
+    return 1;
+}
+
+/* ... = value:value(),the arguments that create it */
+static int value_value( lua_State *L )
+{
+    const bson_value_t *val =
+        (const bson_value_t *)luaL_checkudata( L,1,LBS_VALUE );
+
+    return VALUE_TYPE( val )->push( L,val );
+}
+
+/* type(v1,v2),oid in hex */
+static int value_tostring( lua_State *L )
+{
+    const bson_value_t *val =
+        (const bson_value_t *)luaL_checkudata( L,1,LBS_VALUE );
+    const struct value_type *type = VALUE_TYPE( val );
+
+    int count = ( type->text ? type->text : type->push )( L,val );
+
+    luaL_Buffer b;
+    luaL_buffinit( L,&b );
+    luaL_addstring( &b,type->name );
+    luaL_addchar( &b,'(' );
+    for ( int i = 0;i < count;i ++ )
+    {
+        if ( i > 0 ) luaL_addchar( &b,',' );
+        luaL_tolstring( L,2 + i,NULL );
+        luaL_addvalue( &b );
+    }
+    luaL_addchar( &b,')' );
+    luaL_pushresult( &b );
+
+    return 1;
+}
+
+/* same type and same bson value */
+static int value_eq( lua_State *L )
+{
+    const bson_value_t *val1 =
+        (const bson_value_t *)luaL_checkudata( L,1,LBS_VALUE );
+    const bson_value_t *val2 =
+        (const bson_value_t *)luaL_checkudata( L,2,LBS_VALUE );
+
+    if ( val1->value_type != val2->value_type )
+    {
+        lua_pushboolean( L,0 );
+        return 1;
+    }
+
+    bson_t doc1,doc2;
+    bson_init( &doc1 );
+    bson_init( &doc2 );
+    bson_append_value( &doc1,"",0,val1 );
+    bson_append_value( &doc2,"",0,val2 );
+
+    lua_pushboolean( L,doc1.len == doc2.len && 0 == memcmp(
+        bson_get_data( &doc1 ),bson_get_data( &doc2 ),doc1.len ) );
+
+    bson_destroy( &doc1 );
+    bson_destroy( &doc2 );
+
+    return 1;
+}
+
+static const luaL_Reg value_lib[] =
+{
+    {"type",value_typename},
+    {"value",value_value},
+    {"__tostring",value_tostring},
+    {"__eq",value_eq},
+    {"__gc",value_gc},
+    {NULL,NULL}
+};
+
+/* =================================PATCH=================================== */
+
+/* rewrite fields of a encoded document without encoding the whole table
+ * again.a element of the same size is overwritten in place,otherwise the
+ * bytes after it are moved and the length of every enclosing document is
+ * fixed up,so the cost depend on the change,not the document size
+ */
+struct patch_buf
+{
+    uint8_t *data;  /* the document */
+    size_t len;     /* length of the document */
+    size_t cap;     /* bytes can be used from data */
+    int fixed;      /* caller's buffer,can't grow */
+};
+
+static inline uint32_t patch_get_len( const uint8_t *data )
+{
+    uint32_t len_le = 0;
+    memcpy( &len_le,data,sizeof(len_le) );
+    return BSON_UINT32_FROM_LE( len_le );
+}
+
+static inline void patch_set_len( uint8_t *data,uint32_t len )
+{
+    uint32_t len_le = BSON_UINT32_TO_LE( len );
+    memcpy( data,&len_le,sizeof(len_le) );
+}
+
+/* locate the element of path,[*start,*end) are it's bytes.return 0 if
+ * found,PATCH_APPEND if the last segment is not found,both are the
+ * terminating byte of it's document so the element is appended there,
+ * PATCH_MISSING if a document on the path is not found.docs[i] is the
+ * offset of the document at level i
+ */
+#define PATCH_APPEND  1
+#define PATCH_MISSING 2
+
+static int patch_find( struct patch_buf *pb,const struct get_path *gp,
+    size_t *docs,size_t *start,size_t *end,struct error_collector *ec )
+{
+    bson_iter_t iter;
+    if ( !bson_iter_init_from_data( &iter,pb->data,pb->len ) )
+    {
+        ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson document" );
+        return -1;
+    }
+
+    docs[0] = 0;
+    for ( int level = 0;level < gp->depth;level ++ )
+    {
+        int found = 0;
+        int key_len = gp->seg_len[level];
+        while ( bson_iter_next( &iter ) )
+        {
+            if ( bson_iter_key_len( &iter ) == (uint32_t)key_len
+                && 0 == memcmp( bson_iter_key( &iter ),gp->seg[level],key_len ) )
             {
-                case LUA_TBOOLEAN :
-                {
-                    if ( lua_toboolean( L,-2 ) )
-                        snprintf( key,MAX_KEY_LENGTH,"true" );
-                    else
-                        snprintf( key,MAX_KEY_LENGTH,"false" );
-                    pkey = key;
-                }break;
-                case LUA_TNUMBER  :
-                {
-                    if ( lua_isinteger( L,-2 ) )
-                        snprintf( key,MAX_KEY_LENGTH,
-                            LUA_INTEGER_FMT,lua_tointeger( L,-2 ) );
-                    else
-                        snprintf( key,MAX_KEY_LENGTH,
-                            LUA_NUMBER_FMT,lua_tonumber( L,-2 ) );
-                    pkey = key;
-                }break;
-                case LUA_TSTRING :
-                {
-                    size_t len = 0;
-                    pkey = lua_tolstring( L,-2,&len );
-                    if ( len > MAX_KEY_LENGTH - 1 )
-                    {
-                        bson_destroy( doc );
-                        lua_pop( L,2 );
-                        ERROR_LOG( ec,"lua table string key too long\n" );
-                        return NULL;
-                    }
-                }break;
-                default :
-                {
-                    bson_destroy( doc );
-                    lua_pop( L,2 );
-                    ERROR_LOG( ec,"can not convert %s to bson key\n",
-                        lua_typename( L,lua_type( L,-2 ) ) );
-                    return NULL;
-                }break;
+                found = 1;
+                break;
             }
+        }
 
-            assert( pkey );
-            if ( value_encode( L,doc,pkey,stack_top + 2,ec ) < 0 )
+        if ( !found )
+        {
+            if ( level < gp->depth - 1 )
             {
-                lua_pop( L,2 );
-                bson_destroy( doc );
+                ERROR_LOG( ec,LBS_ERROR_TYPE,
+                    "patch field %.*s not found",key_len,gp->seg[level] );
+                return PATCH_MISSING;
+            }
 
-                return NULL;
+            *start = *end = docs[level] + patch_get_len( pb->data + docs[level] ) - 1;
+            return PATCH_APPEND;
+        }
+
+        size_t raw = (size_t)( iter.raw - pb->data );
+        if ( level == gp->depth - 1 )
+        {
+            *start = raw + iter.off;
+            *end   = raw + iter.next_off;
+            return 0;
+        }
+
+        bson_iter_t child;
+        if ( ( !BSON_ITER_HOLDS_DOCUMENT( &iter ) && !BSON_ITER_HOLDS_ARRAY( &iter ) )
+            || !bson_iter_recurse( &iter,&child ) )
+        {
+            ERROR_LOG( ec,LBS_ERROR_TYPE,
+                "patch field %.*s is not a document",key_len,gp->seg[level] );
+            return -1;
+        }
+
+        docs[level + 1] = (size_t)( child.raw - pb->data );
+        iter = child;
+    }
+
+    return 0;
+}
+
+/* replace bytes [start,end) with the element of size bytes.the length of
+ * the documents in docs[0,depth) are fixed up
+ */
+static int patch_splice( struct patch_buf *pb,const size_t *docs,int depth,
+    size_t start,size_t end,const uint8_t *bytes,size_t size,
+    struct error_collector *ec )
+{
+    size_t old_size = end - start;
+    if ( size != old_size )
+    {
+        size_t len = pb->len - old_size + size;
+        if ( len > INT32_MAX )
+        {
+            ERROR_LOG( ec,LBS_ERROR_SIZE,"document too large" );
+            return -1;
+        }
+
+        if ( len > pb->cap )
+        {
+            if ( pb->fixed )
+            {
+                ERROR_LOG( ec,LBS_ERROR_SIZE,
+                    "buffer too small,%zu bytes needed",len );
+                return -1;
+            }
+
+            size_t cap = pb->cap * 2;
+            if ( cap < len ) cap = len;
+
+            uint8_t *data = (uint8_t *)realloc( pb->data,cap );
+            if ( !data )
+            {
+                ERROR_LOG( ec,LBS_ERROR_MEMORY,"out of memory" );
+                return -1;
             }
 
-            /* removes 'value'; keeps 'key' for next iteration */
-            lua_pop(L, 1);
+            pb->data = data;
+            pb->cap  = cap;
         }
+
+        memmove( pb->data + start + size,pb->data + end,pb->len - end );
+        for ( int i = 0;i < depth;i ++ )
+        {
+            uint8_t *doc = pb->data + docs[i];
+            patch_set_len( doc,(uint32_t)( patch_get_len( doc ) - old_size + size ) );
+        }
+        pb->len = len;
     }
 
-    assert( stack_top == lua_gettop(L) );
+    if ( size > 0 ) memcpy( pb->data + start,bytes,size );
+    return 0;
+}
 
-    if ( array ) *array = _is_array;
+/* set the field of path to the value at index */
+static int patch_field( lua_State *L,struct patch_buf *pb,
+    const char *path,size_t path_len,int index,struct encode_ctx *ctx )
+{
+    struct get_path gp;
+    if ( get_path_parse( &gp,path,path_len ) < 0 )
+    {
+        ERROR_LOG( ctx->ec,LBS_ERROR_DEPTH,"patch path too deep" );
+        return -1;
+    }
 
-    return doc;
+    size_t start = 0;
+    size_t end = 0;
+    size_t docs[GET_MAX_DEPTH];
+    int found = patch_find( pb,&gp,docs,&start,&end,ctx->ec );
+    if ( found < 0 || PATCH_MISSING == found ) return -1;
+
+    /* encode the element alone,it's bytes are between the length and the
+     * terminating byte of a temporary document
+     */
+    bson_t elem;
+    bson_init( &elem );
+    int ret = value_encode( L,&elem,gp.seg[gp.depth - 1],
+        gp.seg_len[gp.depth - 1],index,ctx );
+    if ( ret >= 0 )
+    {
+        ret = patch_splice( pb,docs,gp.depth,start,end,
+            bson_get_data( &elem ) + 4,elem.len - 5,ctx->ec );
+    }
+    bson_destroy( &elem );
+
+    return ret;
+}
+
+/* apply every path = value in the table at index 2 */
+static int patch_fields( lua_State *L,
+    struct patch_buf *pb,struct error_collector *ec )
+{
+    struct encode_ctx ctx;
+    ENCODE_CTX_INIT( &ctx,ec );
+
+    lua_pushnil( L );
+    while ( lua_next( L,2 ) != 0 )
+    {
+        if ( LUA_TSTRING != lua_type( L,-2 ) )
+        {
+            lua_pop( L,2 );
+            ERROR_LOG( ec,LBS_ERROR_TYPE,"patch path must be string" );
+            return -1;
+        }
+
+        size_t len = 0;
+        const char *path = lua_tolstring( L,-2,&len );
+        if ( patch_field( L,pb,path,len,lua_gettop( L ),&ctx ) < 0 )
+        {
+            lua_pop( L,2 );
+            return -1;
+        }
+
+        lua_pop( L,1 );
+    }
+
+    return 0;
 }
 
+/* change the document in pb by the argument at index 2 */
+typedef int (*patch_func)( lua_State *L,
+    struct patch_buf *pb,struct error_collector *ec );
 
-/* decode a bson document into a lua table,push the table into stack
- * https://docs.mongodb.org/v3.0/reference/bson-types/
- * {
- * BSON_TYPE_EOD           = 0x00,
- * BSON_TYPE_DOUBLE        = 0x01,
- * BSON_TYPE_UTF8          = 0x02,
- * BSON_TYPE_DOCUMENT      = 0x03,
- * BSON_TYPE_ARRAY         = 0x04,
- * BSON_TYPE_BINARY        = 0x05,
- * BSON_TYPE_UNDEFINED     = 0x06,
- * BSON_TYPE_OID           = 0x07,
- * BSON_TYPE_BOOL          = 0x08,
- * BSON_TYPE_DATE_TIME     = 0x09,
- * BSON_TYPE_NULL          = 0x0A,
- * BSON_TYPE_REGEX         = 0x0B,
- * BSON_TYPE_DBPOINTER     = 0x0C,
- * BSON_TYPE_CODE          = 0x0D,
- * BSON_TYPE_SYMBOL        = 0x0E,
- * BSON_TYPE_CODEWSCOPE    = 0x0F,
- * BSON_TYPE_INT32         = 0x10,
- * BSON_TYPE_TIMESTAMP     = 0x11,
- * BSON_TYPE_INT64         = 0x12,
- * BSON_TYPE_MAXKEY        = 0x7F,
- * BSON_TYPE_MINKEY        = 0xFF,
- * } bson_type_t;
-*/
-int bson_decode( lua_State*L,bson_iter_t *iter,
-    bson_type_t root_type,struct error_collector *ec )
+/* a string buffer is copied once,patched and pushed as a new string */
+static int patch_string( lua_State *L,
+    patch_func func,struct error_collector *ec )
+{
+    size_t sz = 0;
+    const char *buffer = lua_tolstring( L,1,&sz );
+
+    lua_Integer offset = luaL_optinteger( L,4,0 );
+    if ( offset < 0 || (size_t)offset > sz )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"offset out of range" );
+        return -1;
+    }
+
+    size_t size = sz - (size_t)offset;
+    lua_Integer length = luaL_optinteger( L,5,(lua_Integer)size );
+    if ( length < 0 || (size_t)length > size )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"length out of range" );
+        return -1;
+    }
+
+    bson_t doc;
+    const uint8_t *data = (const uint8_t *)buffer + offset;
+    if ( doc_init_static( data,(size_t)length,&doc,ec ) < 0 ) return -1;
+
+    struct patch_buf pb;
+    pb.len   = doc.len;
+    pb.cap   = doc.len;
+    pb.fixed = 0;
+    pb.data  = (uint8_t *)malloc( pb.cap );
+    if ( !pb.data )
+    {
+        ERROR_LOG( ec,LBS_ERROR_MEMORY,"out of memory" );
+        return -1;
+    }
+    memcpy( pb.data,data,pb.len );
+
+    if ( func( L,&pb,ec ) < 0 )
+    {
+        free( pb.data );
+        return -1;
+    }
+
+    lua_pushlstring( L,(const char *)pb.data,pb.len );
+    free( pb.data );
+
+    return 0;
+}
+
+/* a userdata buffer is patched in place,the length is pushed */
+static int patch_userdata( lua_State *L,
+    patch_func func,struct error_collector *ec )
+{
+    uint8_t *base = NULL;
+    size_t size = 0;
+    lua_Integer offset = luaL_optinteger( L,4,0 );
+
+    if ( userdata_buffer( L,1,5,&base,&size,ec ) < 0 ) return -1;
+    if ( offset < 0 || (size_t)offset > size )
+    {
+        ERROR_LOG( ec,LBS_ERROR_SIZE,"offset out of range" );
+        return -1;
+    }
+
+    bson_t doc;
+    size -= (size_t)offset;
+    if ( doc_init_static( base + offset,size,&doc,ec ) < 0 ) return -1;
+
+    struct patch_buf pb;
+    pb.data  = base + offset;
+    pb.len   = doc.len;
+    pb.cap   = size;
+    pb.fixed = 1;
+
+    if ( func( L,&pb,ec ) < 0 ) return -1;
+
+    lua_pushinteger( L,(lua_Integer)pb.len );
+    return 0;
+}
+
+/* buffer,error = patch( buffer,fields,nothrow,offset,length )
+ * fields is a table of path = value,path is dotted as get.a field not
+ * found is appended to it's document.a string buffer is copied and the
+ * patched document is returned,offset and length locate it as decode.a
+ * userdata buffer is patched in place and the new length is returned,
+ * length is the buffer size then(required for lightuserdata).the buffer
+ * may be partly patched if a error occur
+ */
+static int lbs_patch( lua_State *L )
+{
+    struct error_collector ec;
+    ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
+
+    int nothrow = lua_toboolean( L,3 );
+    lua_settop( L,5 );
+
+    int ret = -1;
+    if ( !lua_istable( L,2 ) )
+    {
+        ERROR_LOG( (&ec),LBS_ERROR_TYPE,"argument #2 table expected,got %s",
+            lua_typename( L,lua_type(L,2) ) );
+    }
+    else if ( LUA_TSTRING == lua_type( L,1 ) )
+    {
+        ret = patch_string( L,patch_fields,&ec );
+    }
+    else
+    {
+        ret = patch_userdata( L,patch_fields,&ec );
+    }
+
+    if ( ret >= 0 ) return 1;
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
+
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
+
+/* =================================DIFF==================================== */
+
+/* delta of two encoded documents as { $set = { path = value },
+ * $unset = { path = true } },path is dotted as get.both documents are
+ * walked in lockstep over the raw bytes,a sub document in both is compared
+ * field by field,other elements are compared as bytes
+ */
+#define DIFF_MAX_PATH 1024
+
+struct diff_ctx
+{
+    bson_t set;
+    bson_t unset;
+    struct error_collector *ec;
+    char path[DIFF_MAX_PATH];
+};
+
+/* append key to the path of parent,which is len bytes */
+static int diff_path( struct diff_ctx *dc,int len,const char *key,int key_len )
+{
+    int sep = len > 0 ? 1 : 0;
+    if ( len + sep + key_len >= DIFF_MAX_PATH )
+    {
+        ERROR_LOG( dc->ec,LBS_ERROR_DEPTH,"diff path too long" );
+        return -1;
+    }
+
+    if ( sep ) dc->path[len] = '.';
+    memcpy( dc->path + len + sep,key,key_len );
+
+    return len + sep + key_len;
+}
+
+/* the bytes of current element,type and key included */
+static inline const uint8_t *diff_element( const bson_iter_t *iter,size_t *size )
+{
+    *size = iter->next_off - iter->off;
+    return iter->raw + iter->off;
+}
+
+/* old keys matched by a new one,bit i for the i-th old key.small documents
+ * use the bits on stack
+ */
+#define DIFF_SEEN_WORDS 4
+
+struct diff_seen
+{
+    uint64_t *bits;
+    int words;
+    uint64_t local[DIFF_SEEN_WORDS];
+};
+
+static void diff_seen_init( struct diff_seen *seen )
+{
+    memset( seen->local,0,sizeof(seen->local) );
+    seen->bits  = seen->local;
+    seen->words = DIFF_SEEN_WORDS;
+}
+
+static void diff_seen_free( struct diff_seen *seen )
+{
+    if ( seen->bits != seen->local ) free( seen->bits );
+}
+
+static int diff_seen_set( struct diff_seen *seen,int pos )
 {
-    if ( lua_gettop(L) > MAX_LUA_STACK || !lua_checkstack(L,3) )
+    int word = pos / 64;
+    if ( word >= seen->words )
     {
-        ERROR_LOG( ec,"bson_decode stack overflow" );
-        return -1;
-    }
+        int words = seen->words * 2;
+        while ( words <= word ) words *= 2;
 
-    lua_newtable( L );
-    while ( bson_iter_next( iter ) )
-    {
-        const char *key = bson_iter_key( iter );
-        if ( value_decode( L,iter,ec ) < 0 )
-        {
-            lua_pop( L,1 );
-            return      -1;
-        }
+        uint64_t *bits = (uint64_t *)
+            realloc( seen->bits == seen->local ? NULL : seen->bits,
+            words * sizeof(uint64_t) );
+        if ( !bits ) return -1;
 
-        if ( BSON_TYPE_ARRAY == root_type )
-        {
-            /* lua array index start from 1
-             * lua_rawseti will set nil value in a sparse array
-             */
-            lua_seti( L,-2,strtol(key,NULL,10) + 1 );
-        }
-        else
+        if ( seen->bits == seen->local )
         {
-            /* no lua_rawsetfield ?? */
-            lua_setfield( L,-2,key );
+            memcpy( bits,seen->local,sizeof(seen->local) );
         }
+        memset( bits + seen->words,0,
+            ( words - seen->words ) * sizeof(uint64_t) );
+
+        seen->bits  = bits;
+        seen->words = words;
     }
 
+    seen->bits[word] |= (uint64_t)1 << ( pos % 64 );
     return 0;
 }
 
-int lbs_do_decode( lua_State *L,
-    const bson_t *doc,bson_type_t root_type,struct error_collector *ec )
+static inline int diff_seen_get( const struct diff_seen *seen,int pos )
 {
-    bson_iter_t iter;
-    if ( !bson_iter_init( &iter, doc ) )
-    {
-        ERROR_LOG( ec,"invalid bson document" );
+    int word = pos / 64;
+    return word < seen->words
+        && ( seen->bits[word] & ( (uint64_t)1 << ( pos % 64 ) ) );
+}
 
-       return -1;
+/* find key in doc from the begining,return the position or -1 */
+static int diff_find( const bson_iter_t *doc,
+    bson_iter_t *iter,const char *key,int key_len )
+{
+    int pos = 0;
+    *iter = *doc;
+    while ( bson_iter_next( iter ) )
+    {
+        if ( bson_iter_key_len( iter ) == (uint32_t)key_len
+            && 0 == memcmp( bson_iter_key( iter ),key,key_len ) )
+        {
+            return pos;
+        }
+        ++pos;
     }
 
-    return bson_decode( L,&iter,root_type,ec );
+    return -1;
 }
 
-/* encode varibale in lua stack start from index
- * only number、table、boolean support.other type
- * will raise a error
- */
-int lbs_do_encode_stack( lua_State *L,
-    bson_t *doc,int index,struct error_collector *ec )
+static int diff_doc( struct diff_ctx *dc,const bson_iter_t *old_doc,
+    const bson_iter_t *new_doc,int path_len,int depth );
+
+/* a key with '.' can't be a path segment,as apply split path by '.' */
+static int diff_plain_keys( const bson_iter_t *doc )
 {
-    assert( doc );
-    int top = lua_gettop( L );
-    if ( index > top )
+    bson_iter_t iter = *doc;
+    while ( bson_iter_next( &iter ) )
     {
-        ERROR_LOG( ec,"nothing in stack to be encoded" );
-
-        return -1;
+        if ( memchr( bson_iter_key( &iter ),'.',bson_iter_key_len( &iter ) ) )
+        {
+            return 0;
+        }
     }
 
-    unsigned int key_index = bson_count_keys( doc );
-    char key[MAX_KEY_LENGTH] = { 0 };
-    for ( int i = index;i <= top;i ++ )
+    return 1;
+}
+
+/* compare the element of new iter with the matched old one,append it to
+ * $set if changed.a sub document is compared field by field,unless its
+ * path would be too deep for apply or a key of it contain '.'
+ */
+static int diff_value( struct diff_ctx *dc,const bson_iter_t *old,
+    bson_iter_t *iter,int len,int depth )
+{
+    bson_type_t type = bson_iter_type( iter );
+    if ( type == bson_iter_type( old ) && depth < GET_MAX_DEPTH - 1
+        && ( BSON_TYPE_DOCUMENT == type || BSON_TYPE_ARRAY == type ) )
     {
-        snprintf( key,MAX_KEY_LENGTH,"%u",key_index++ );
-        if ( value_encode( L,doc,key,i,ec ) < 0 )
+        bson_iter_t old_child;
+        bson_iter_t new_child;
+        if ( !bson_iter_recurse( old,&old_child )
+            || !bson_iter_recurse( iter,&new_child ) )
         {
+            ERROR_LOG( dc->ec,LBS_ERROR_BSON,
+                "bson document iter recurse error" );
             return -1;
         }
+
+        if ( diff_plain_keys( &old_child ) && diff_plain_keys( &new_child ) )
+        {
+            return diff_doc( dc,&old_child,&new_child,len,depth + 1 );
+        }
+    }
+
+    size_t old_size = 0;
+    size_t new_size = 0;
+    const uint8_t *old_bytes = diff_element( old,&old_size );
+    const uint8_t *new_bytes = diff_element( iter,&new_size );
+    if ( old_size != new_size || 0 != memcmp( old_bytes,new_bytes,new_size ) )
+    {
+        bson_append_value( &dc->set,dc->path,len,bson_iter_value( iter ) );
     }
 
     return 0;
 }
 
-/* decode doc into lua stack
- * return the number of variable push into stack
+/* fields are in the same order usually,so old cursor move with the new one
+ * and a key out of order is looked up from the begining,which move the
+ * cursor to it.matched old keys are marked,the unmarked ones are removed
  */
-int lbs_do_decode_stack( lua_State *L,
-    const bson_t *doc,struct error_collector *ec )
+static int diff_doc( struct diff_ctx *dc,const bson_iter_t *old_doc,
+    const bson_iter_t *new_doc,int path_len,int depth )
 {
-    bson_iter_t iter;
-    if ( !bson_iter_init( &iter, doc ) )
-    {
-        ERROR_LOG( ec,"invalid bson document" );
+    struct diff_seen seen;
+    diff_seen_init( &seen );
 
-       return -1;
-    }
-
-    int cnt = 0;
-    int top = lua_gettop( L );
+    int cur_pos = -1;
+    bson_iter_t cur = *old_doc;
+    bson_iter_t iter = *new_doc;
     while ( bson_iter_next( &iter ) )
     {
-        if ( cnt + top > MAX_LUA_STACK || !lua_checkstack( L,1 ) )
+        const char *key = bson_iter_key( &iter );
+        int key_len = (int)bson_iter_key_len( &iter );
+        int len = diff_path( dc,path_len,key,key_len );
+        if ( len < 0 ) goto error;
+
+        int pos = cur_pos + 1;
+        bson_iter_t old = cur;
+        if ( !bson_iter_next( &old )
+            || bson_iter_key_len( &old ) != (uint32_t)key_len
+            || 0 != memcmp( bson_iter_key( &old ),key,key_len ) )
         {
-            lua_settop( L,top );
-            ERROR_LOG( ec,"lbs_decode_stack stack overflow" );
-            return -1;
+            pos = diff_find( old_doc,&old,key,key_len );
         }
 
-        if ( value_decode( L,&iter,ec ) < 0 )
+        if ( pos < 0 )
         {
-            lua_settop( L,top );
-            return      -1;
+            bson_append_value( &dc->set,dc->path,len,bson_iter_value( &iter ) );
+            continue;
         }
 
-        ++cnt;
+        cur = old;
+        cur_pos = pos;
+        if ( diff_seen_set( &seen,pos ) < 0 )
+        {
+            ERROR_LOG( dc->ec,LBS_ERROR_MEMORY,"out of memory" );
+            goto error;
+        }
+        if ( diff_value( dc,&old,&iter,len,depth ) < 0 ) goto error;
     }
 
-    return cnt;
+    int pos = 0;
+    iter = *old_doc;
+    while ( bson_iter_next( &iter ) )
+    {
+        if ( diff_seen_get( &seen,pos++ ) ) continue;
+
+        const char *key = bson_iter_key( &iter );
+        int len = diff_path( dc,path_len,key,(int)bson_iter_key_len( &iter ) );
+        if ( len < 0 ) goto error;
+
+        bson_append_bool( &dc->unset,dc->path,len,1 );
+    }
+
+    diff_seen_free( &seen );
+    return 0;
+
+error:
+    diff_seen_free( &seen );
+    return -1;
 }
 
-/* encode lua table into a bson buffer */
-static int lbs_encode( lua_State *L )
+/* init doc over the whole lua string at index */
+static int diff_doc_init( lua_State *L,
+    int index,bson_t *doc,struct error_collector *ec )
 {
-    struct error_collector ec;
-    ec.what[0] = 0;
+    if ( lua_type( L,index ) != LUA_TSTRING )
+    {
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"argument #%d string expected,got %s",
+            index,lua_typename( L,lua_type(L,index) ) );
+        return -1;
+    }
 
-    int success = 0;
-    int nothrow = lua_toboolean( L,2 );
+    size_t sz = 0;
+    const char *buffer = lua_tolstring( L,index,&sz );
 
-    if ( !lua_istable( L,1 ) )
+    return doc_init_static( (const uint8_t *)buffer,sz,doc,ec );
+}
+
+/* push the delta from old_doc to new_doc as a string */
+static int diff( lua_State *L,const bson_t *old_doc,
+    const bson_t *new_doc,struct error_collector *ec )
+{
+    bson_iter_t old_iter;
+    bson_iter_t new_iter;
+    if ( !bson_iter_init( &old_iter,old_doc )
+        || !bson_iter_init( &new_iter,new_doc ) )
     {
-        snprintf( ec.what,LBS_MAX_ERROR_MSG,"argument #1 table expected,got %s",
-                    lua_typename( L,lua_type(L,1) ) );
-        lua_pushnil( L ); /* fail,make sure buffer is nil */
+        ERROR_LOG( ec,LBS_ERROR_BSON,"invalid bson document" );
+        return -1;
     }
-    else
+
+    /* the root can't be set as a whole */
+    if ( !diff_plain_keys( &old_iter ) || !diff_plain_keys( &new_iter ) )
     {
-        bson_t *doc = lbs_do_encode( L,1,NULL,&ec );
-        if ( doc )
-        {
-            const char *buffer = (const char *)bson_get_data( doc );
-            lua_pushlstring( L,buffer,doc->len );
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"diff can not express a key with '.'" );
+        return -1;
+    }
 
-            bson_destroy( doc );
-            success = 1;
-            return    1;
+    struct diff_ctx dc;
+    dc.ec = ec;
+    bson_init( &dc.set );
+    bson_init( &dc.unset );
+
+    int ret = diff_doc( &dc,&old_iter,&new_iter,0,0 );
+    if ( ret >= 0 )
+    {
+        bson_t delta;
+        bson_init( &delta );
+        if ( !bson_empty( &dc.set ) )
+        {
+            bson_append_document( &delta,"$set",4,&dc.set );
+        }
+        if ( !bson_empty( &dc.unset ) )
+        {
+            bson_append_document( &delta,"$unset",6,&dc.unset );
         }
 
-        lua_pushnil( L ); /* fail,make sure buffer is nil */
+        lua_pushlstring( L,(const char *)bson_get_data( &delta ),delta.len );
+        bson_destroy( &delta );
     }
 
-    if ( !success )
-    {
-        if ( nothrow ) lua_pushstring( L,ec.what );
-        else luaL_error( L,ec.what );
-    }
+    bson_destroy( &dc.set );
+    bson_destroy( &dc.unset );
 
-    return 2;
+    return ret;
 }
 
-/* decode a bson buffer into a lua table */
-static int lbs_decode( lua_State *L )
+/* delta,error = diff( old,new,nothrow ) */
+static int lbs_diff( lua_State *L )
 {
     struct error_collector ec;
     ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
 
-    int nothrow = lua_toboolean( L,2 );
-    if ( !lua_isstring( L,1 ) )
+    int nothrow = lua_toboolean( L,3 );
+
+    bson_t old_doc;
+    bson_t new_doc;
+    if ( diff_doc_init( L,1,&old_doc,&ec ) >= 0
+        && diff_doc_init( L,2,&new_doc,&ec ) >= 0
+        && diff( L,&old_doc,&new_doc,&ec ) >= 0 )
     {
-        snprintf( ec.what,LBS_MAX_ERROR_MSG,"argument #1 string expected,got %s",
-                    lua_typename( L,lua_type(L,1) ) );
-        goto DONE_ERROR;
+        return 1;
     }
 
-    size_t sz = 0;
-    const char *buffer = luaL_tolstring( L,1,&sz );
-
-    bson_reader_t *reader = bson_reader_new_from_data( (const uint8_t *)buffer,sz );
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
 
-    const bson_t *doc = bson_reader_read( reader,NULL );
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
+    return 2;
+}
 
-    if ( !doc )
+/* apply the fields of $set or $unset in delta */
+static int apply_fields( struct patch_buf *pb,
+    const bson_iter_t *iter,int unset,struct error_collector *ec )
+{
+    bson_iter_t field;
+    if ( !bson_iter_recurse( iter,&field ) )
     {
-        ERROR_LOG( (&ec),"invalid bson buffer" );
-
-        bson_reader_destroy( reader );
-        goto DONE_ERROR;
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"invalid delta" );
+        return -1;
     }
 
-    /* root type always be a document in bson */
-    if ( lbs_do_decode( L,doc,BSON_TYPE_DOCUMENT,&ec ) >= 0 )
+    while ( bson_iter_next( &field ) )
     {
-        bson_reader_destroy( reader );
-        return 1;
-    }
+        struct get_path gp;
+        const char *path = bson_iter_key( &field );
+        if ( get_path_parse( &gp,path,bson_iter_key_len( &field ) ) < 0 )
+        {
+            ERROR_LOG( ec,LBS_ERROR_DEPTH,"patch path too deep" );
+            return -1;
+        }
 
-DONE_ERROR:
-    if ( !nothrow )
-    {
-        luaL_error( L,ec.what );
-        return 0; /* in fact,it never return */
-    }
+        size_t start = 0;
+        size_t end = 0;
+        size_t docs[GET_MAX_DEPTH];
+        int found = patch_find( pb,&gp,docs,&start,&end,ec );
+        if ( found < 0 ) return -1;
 
-    /* do not raise a error,return error message instead */
-    lua_pushnil( L ); /* fail,make sure buffer is nil */
-    lua_pushstring( L,ec.what );
+        if ( unset )
+        {
+            /* a field already removed is fine */
+            if ( 0 != found ) continue;
+            if ( patch_splice( pb,docs,gp.depth,start,end,NULL,0,ec ) < 0 )
+            {
+                return -1;
+            }
+            continue;
+        }
 
-    return 2;
+        if ( PATCH_MISSING == found ) return -1;
+
+        /* the element with the last segment as key */
+        bson_t elem;
+        bson_init( &elem );
+        bson_append_value( &elem,gp.seg[gp.depth - 1],
+            gp.seg_len[gp.depth - 1],bson_iter_value( &field ) );
+
+        int ret = patch_splice( pb,docs,gp.depth,start,end,
+            bson_get_data( &elem ) + 4,elem.len - 5,ec );
+        bson_destroy( &elem );
+
+        if ( ret < 0 ) return -1;
+    }
+
+    return 0;
 }
 
-/* generate a objectid */
-static int lbs_object_id( lua_State *L )
+/* apply the delta string at index 2 */
+static int apply_delta( lua_State *L,
+    struct patch_buf *pb,struct error_collector *ec )
 {
-    bson_oid_t oid;
-
-    bson_oid_init( &oid, NULL );
+    bson_t delta;
+    if ( diff_doc_init( L,2,&delta,ec ) < 0 ) return -1;
 
-    char str[25];
+    bson_iter_t iter;
+    if ( !bson_iter_init( &iter,&delta ) )
+    {
+        ERROR_LOG( ec,LBS_ERROR_TYPE,"invalid delta" );
+        return -1;
+    }
 
-    bson_oid_to_string( &oid, str );
+    while ( bson_iter_next( &iter ) )
+    {
+        const char *key = bson_iter_key( &iter );
+        int unset = 0 == strcmp( key,"$unset" );
+        if ( ( !unset && 0 != strcmp( key,"$set" ) )
+            || !BSON_ITER_HOLDS_DOCUMENT( &iter ) )
+        {
+            ERROR_LOG( ec,LBS_ERROR_TYPE,"invalid delta field %s",key );
+            return -1;
+        }
 
-    lua_pushlstring( L,str, sizeof(str) );
+        if ( apply_fields( pb,&iter,unset,ec ) < 0 ) return -1;
+    }
 
-    return 1;
+    return 0;
 }
 
-static int lbs_encode_stack( lua_State *L )
+/* buffer,error = apply( buffer,delta,nothrow,offset,length )
+ * apply a delta from diff.buffer,offset and length are the same as patch
+ */
+static int lbs_apply( lua_State *L )
 {
     struct error_collector ec;
     ec.what[0] = 0;
+    ec.kind = LBS_ERROR_NONE;
 
-    int nothrow = lua_toboolean( L,1 );
-    bson_t *doc = bson_new();
-    int err = lbs_do_encode_stack( L,doc,2,&ec );
-    if (  0 == err )
+    int nothrow = lua_toboolean( L,3 );
+    lua_settop( L,5 );
+
+    int ret = -1;
+    if ( LUA_TSTRING == lua_type( L,1 ) )
     {
-        const char *buffer = (const char *)bson_get_data( doc );
-        lua_pushlstring( L,buffer,doc->len );
+        ret = patch_string( L,apply_delta,&ec );
     }
-
-    bson_destroy( doc );
-
-    if ( 0 == err ) return 1;
-
-    if ( !nothrow )
+    else
     {
-        luaL_error( L,ec.what );
-        return 0; /* in fact,it never return */
+        ret = patch_userdata( L,apply_delta,&ec );
     }
 
-    /* do not raise a error,return error message instead */
-    lua_pushnil( L ); /* fail,make sure buffer is nil */
-    lua_pushstring( L,ec.what );
+    if ( ret >= 0 ) return 1;
+
+    if ( !nothrow ) return luaL_error( L,"%s",ec.what );
 
+    lua_pushnil( L );
+    lua_pushstring( L,ec.what );
     return 2;
 }
 
-static int lbs_decode_stack( lua_State *L )
+/* ===============================KEY CACHE================================= */
+
+/* key_cache( size ),enable decode key cache with size slots,0 to disable */
+static int lbs_key_cache( lua_State *L )
 {
-    struct error_collector ec;
-    ec.what[0] = 0;
+    lua_Integer size = luaL_checkinteger( L,1 );
+    luaL_argcheck( L,size >= 0 && size <= KEY_CACHE_MAX_SIZE,1,
+        "invalid key cache size" );
 
-    int nothrow = lua_toboolean( L,2 );
+    if ( 0 == size )
+    {
+        lua_pushnil( L );
+        lua_rawsetp( L,LUA_REGISTRYINDEX,&key_cache_key );
+        return 0;
+    }
 
-    size_t sz = 0;
-    const char *buffer = luaL_tolstring( L,1,&sz );
+    uint32_t slots = 1;
+    while ( slots < (uint32_t)size ) slots *= 2;
 
-    bson_reader_t *reader = bson_reader_new_from_data( (const uint8_t *)buffer,sz );
+    struct key_cache *cache = (struct key_cache *)lua_newuserdata( L,
+        sizeof(struct key_cache) + sizeof(struct key_slot) * ( slots - 1 ) );
+    memset( cache,0,sizeof(struct key_cache) );
+    cache->size = slots;
+    for ( uint32_t i = 0;i < slots;i ++ ) cache->slots[i].len = -1;
 
-    const bson_t *doc = bson_reader_read( reader,NULL );
-    if ( !doc )
-    {
-        ERROR_LOG( (&ec),"invalid bson buffer" );
+    lua_createtable( L,(int)slots,0 );
+    lua_setuservalue( L,-2 );
+    lua_rawsetp( L,LUA_REGISTRYINDEX,&key_cache_key );
 
-        goto DONE_ERROR;
-    }
+    return 0;
+}
 
-    int num = lbs_do_decode_stack( L,doc,&ec );
-    if ( num > 0 )
+/* stats of key cache,nil if disabled */
+static int lbs_key_cache_stats( lua_State *L )
+{
+    if ( LUA_TUSERDATA != lua_rawgetp( L,LUA_REGISTRYINDEX,&key_cache_key ) )
     {
-        bson_reader_destroy( reader );
-        return num;
+        lua_pushnil( L );
+        return 1;
     }
 
-DONE_ERROR:
-    bson_reader_destroy( reader );
-    if ( !nothrow )
-    {
-        luaL_error( L,ec.what );
-        return 0; /* in fact,it never return */
-    }
+    struct key_cache *cache = (struct key_cache *)lua_touserdata( L,-1 );
 
-    /* do not raise a error,return error message instead */
-    lua_pushnil( L ); /* fail,make sure buffer is nil */
-    lua_pushstring( L,ec.what );
+    lua_createtable( L,0,5 );
+    lua_pushinteger( L,cache->size );
+    lua_setfield( L,-2,"size" );
+    lua_pushinteger( L,cache->used );
+    lua_setfield( L,-2,"used" );
+    lua_pushinteger( L,cache->hits );
+    lua_setfield( L,-2,"hits" );
+    lua_pushinteger( L,cache->misses );
+    lua_setfield( L,-2,"misses" );
+    lua_pushinteger( L,cache->evictions );
+    lua_setfield( L,-2,"evictions" );
 
-    return 2;
+    return 1;
 }
 
 /* ====================LIBRARY INITIALISATION FUNCTION======================= */
@@ -709,12 +7694,90 @@ static const luaL_Reg lua_parson_lib[] =
     {"object_id",lbs_object_id},
     {"encode_stack",lbs_encode_stack},
     {"decode_stack",lbs_decode_stack},
+    {"encoder",lbs_encoder},
+    {"decode_iter",lbs_decode_iter},
+    {"decode_all",lbs_decode_all},
+    {"writer",lbs_writer},
+    {"lazy",lbs_lazy},
+    {"get",lbs_get},
+    {"compile",lbs_compile},
+    {"encode_into",lbs_encode_into},
+    {"decode_from",lbs_decode_from},
+    {"buffer",lbs_buffer},
+    {"enable_stats",lbs_enable_stats},
+    {"stats",lbs_stats},
+    {"reset_stats",lbs_reset_stats},
+    {"memory",lbs_memory},
+    {"decode_batch",lbs_decode_batch},
+    {"encode_async",lbs_encode_async},
+    {"value",lbs_value},
+    {"key_cache",lbs_key_cache},
+    {"key_cache_stats",lbs_key_cache_stats},
+    {"max_depth",lbs_max_depth},
+    {"patch",lbs_patch},
+    {"diff",lbs_diff},
+    {"apply",lbs_apply},
     {NULL, NULL}
 };
 
+/* create a metatable for userdata,methods are indexed by the metatable */
+static void lbs_new_metatable( lua_State *L,const char *name,const luaL_Reg *l )
+{
+    if ( luaL_newmetatable( L,name ) )
+    {
+        lua_pushvalue( L,-1 );
+        lua_setfield( L,-2,"__index" );
+        luaL_setfuncs( L,l,0 );
+    }
+    lua_pop( L,1 );
+}
+
+/* process wide tables shared by every lua state,luaopen_lua_bson may run
+ * in several states on different threads at the same time
+ */
+static pthread_once_t lbs_once = PTHREAD_ONCE_INIT;
+
+static void lbs_init_once()
+{
+    index_key_init();
+    utf8_init();
+}
+
 int luaopen_lua_bson(lua_State *L)
 {
     luaL_checkversion( L );
+
+    pthread_once( &lbs_once,lbs_init_once );
+
+    lbs_new_metatable( L,LBS_ENCODER,encoder_lib );
+    lbs_new_metatable( L,LBS_READER,reader_lib );
+    lbs_new_metatable( L,LBS_WRITER,writer_lib );
+    lbs_new_metatable( L,LBS_CODEC,codec_lib );
+    lbs_new_metatable( L,LBS_BATCH,batch_lib );
+    lbs_new_metatable( L,LBS_ASYNC,async_lib );
+    lbs_new_metatable( L,LBS_VALUE,value_lib );
+
+    /* frames of encode/decode and batch workers,kept by registry until the
+     * state closed
+     */
+    if ( luaL_newmetatable( L,LBS_ENGINE ) )
+    {
+        lua_pushcfunction( L,engine_gc );
+        lua_setfield( L,-2,"__gc" );
+    }
+    lua_pop( L,1 );
+    engine_init( L );
+
+    /* lazy proxy index fields first,then methods */
+    if ( luaL_newmetatable( L,LBS_LAZY ) )
+    {
+        luaL_setfuncs( L,lazy_meta,0 );
+        luaL_newlib( L,lazy_methods );
+        lua_pushcclosure( L,lazy_index,1 );
+        lua_setfield( L,-2,"__index" );
+    }
+    lua_pop( L,1 );
+
     luaL_newlib(L, lua_parson_lib);
     return 1;
 }
@@ -13,10 +13,26 @@ extern "C"
 {
 #endif
 
+/* kind of a error,counted by stats */
+enum lbs_error_kind
+{
+    LBS_ERROR_NONE = 0, /* no error,or a error without kind */
+    LBS_ERROR_TYPE,     /* a value or argument of unsupported type */
+    LBS_ERROR_DEPTH,    /* nested too deep,or stack overflow */
+    LBS_ERROR_UTF8,     /* invalid utf-8 string or key */
+    LBS_ERROR_SIZE,     /* a key,document or range too large */
+    LBS_ERROR_MEMORY,   /* out of memory */
+    LBS_ERROR_BSON,     /* invalid or corrupt bson */
+    LBS_ERROR_CYCLE,    /* a table contain itself,encode with strict */
+
+    LBS_ERROR_MAX
+};
+
 /* collect error info */
 struct error_collector
 {
     char what[LBS_MAX_ERROR_MSG];
+    int kind; /* lbs_error_kind */
 };
 
 #include <lua.h>
@@ -39,6 +55,12 @@ int lbs_do_encode_stack( lua_State *L,
 bson_t *lbs_do_encode( lua_State *L,
     int index,int *array,struct error_collector *ec );
 
+/* same as lbs_do_encode,but append into a document owned by caller,
+ * eg. a bson_t from bson_writer_begin.return -1 on error
+ */
+int lbs_do_encode_into( lua_State *L,
+    bson_t *doc,int index,int *array,struct error_collector *ec );
+
 int lbs_do_decode( lua_State *L,
     const bson_t *doc,bson_type_t root_type,struct error_collector *ec );
 
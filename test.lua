@@ -61,12 +61,15 @@ test_data.empty_array = set_array( {},true )
 test_data.empty_object = set_array( {},false )
 test_data.force_array  = set_array( { phone1 = "123456789",phone2 = "987654321" },true )
 test_data.force_object = set_array( { "USA","UK","CH" },false )
+test_data.mixed = { 1,2,3,x = "x" }
 
 local buffer = bson.encode( test_data )
 print( "test data length:",string.len(buffer) )
 
 local tbl = bson.decode( buffer )
 vd( tbl )
+assert( tbl.mixed["3"] == 3 and tbl.mixed.x == "x" )
+assert( tbl.sparse[10] == "number ten" and #tbl.employees == 3 )
 
 local bf = io.open( "test.bson","rb" )
 local bf_buffer = bf:read( "a" ) -- some version maybe read("*all")
@@ -80,3 +83,299 @@ local bf = bson.encode_stack( true,2,3,4,5,"sdfkasfjdskfksa",
 
 -- that is,local tbl = { bson.decode_stack( bf ) } will lost the nil value
 print( bson.decode_stack( bf ) )
+
+local encoder = bson.encoder()
+for _ = 1,3 do
+    assert( encoder:encode( test_data ) == buffer )
+end
+print( "encoder capacity:",encoder:capacity() )
+print( bson.decode_stack( encoder:encode_stack( true,1,"two",{ 3 } ) ) )
+
+-- decode a document embedded in a larger buffer
+local packet = "head" .. buffer .. "tail"
+local sub = bson.decode( packet,false,4,string.len(buffer) )
+assert( sub.mixed.x == "x" )
+assert( not bson.decode( packet,true,3 ) )
+
+-- concatenated documents
+local all = bson.decode_all( buffer .. bf_buffer .. buffer )
+assert( #all == 3 and all[2].hello == "world" and all[3].mixed.x == "x" )
+
+local count = 0
+for doc in bson.decode_iter( "test.bson","mmap" ) do
+    assert( doc.lua == "bson" )
+    count = count + 1
+end
+assert( 1 == count )
+
+local f = io.open( "test.bson","rb" )
+for doc in bson.decode_iter( f ) do assert( doc.hello == "world" ) end
+f:close()
+
+local writer = bson.writer()
+for i = 1,10 do writer:append( { index = i } ) end
+local stream = writer:tostring()
+assert( writer:size() == string.len( stream ) )
+assert( writer:flush( function( data ) assert( data == stream ) end ) > 0 )
+assert( writer:size() == 0 )
+for i,doc in ipairs( bson.decode_all( stream ) ) do assert( doc.index == i ) end
+
+local proxy = bson.lazy( buffer )
+assert( proxy.employees[2].firstName == "George" and #proxy.employees == 3 )
+assert( proxy.employees == proxy.employees )
+assert( proxy.sparse[10] == "number ten" and proxy.nothing == nil )
+for k,v in pairs( proxy.force_object ) do assert( tbl.force_object[k] == v ) end
+assert( proxy.mixed:materialize().x == "x" )
+
+local name,ten,x,none = bson.get( buffer,
+    "employees.1.firstName","sparse.9","mixed.x","employees.9.none" )
+assert( name == "George" and ten == "number ten" and x == "x" and none == nil )
+
+bson.key_cache( 256 )
+bson.decode( buffer )
+assert( bson.decode( buffer ).employees[3].lastName == "Jones" )
+assert( bson.key_cache_stats().hits > 0 )
+bson.key_cache( 0 )
+assert( bson.key_cache_stats() == nil )
+
+local large = {}
+for i = 1,20000 do large[i] = i end
+local large_decode = bson.decode( bson.encode( { data = large } ) ).data
+assert( #large_decode == 20000 and large_decode[20000] == 20000 )
+
+local codec = bson.compile( { id = "integer",name = "string",hp = "double",
+    flag = "boolean",list = "any",pos = { x = "number",y = "number" } } )
+local msg = { id = 1,name = "codec",hp = 9.5,flag = true,
+    list = { 1,2,3 },pos = { x = 1,y = 2.5 } }
+local msg_decode = codec:decode( codec:encode( msg ) )
+assert( msg_decode.name == "codec" and msg_decode.pos.y == 2.5 )
+assert( msg_decode.list[3] == 3 and bson.decode( codec:encode( msg ) ).hp == 9.5 )
+-- mismatch fall back to generic path
+msg.id = "not integer"
+assert( codec:decode( codec:encode( msg ) ).id == "not integer" )
+msg.id = 1
+msg.extra = "not in schema"
+msg.pos.z = 3
+local strict_codec = bson.compile( { id = "integer",name = "string",
+    hp = "double",flag = "boolean",list = "any",
+    pos = { x = "number",y = "number" } },true )
+local extra_decode = strict_codec:decode( strict_codec:encode( msg ) )
+assert( extra_decode.extra == "not in schema" and extra_decode.pos.z == 3 )
+msg.flag = nil
+assert( codec:decode( codec:encode( msg ) ).extra == "not in schema" )
+assert( math.type( bson.decode( codec:encode( { id = 1,hp = 10 } ) ).hp ) == "float" )
+local big_hp = bson.decode( codec:encode( { id = 1,hp = ( 1 << 53 ) + 1 } ) ).hp
+assert( math.type( big_hp ) == "integer" and big_hp == ( 1 << 53 ) + 1 )
+
+local io_buffer = bson.buffer( 1024 )
+local io_len = bson.encode_into( io_buffer,16,tbl )
+assert( io_len == string.len( bson.encode( tbl ) ) )
+assert( bson.decode_from( io_buffer,false,16,io_len ).employees[2].firstName == "George" )
+assert( not bson.encode_into( bson.buffer( 64 ),0,tbl,true ) )
+
+bson.enable_stats( true )
+bson.reset_stats()
+bson.decode( bson.encode( tbl ) )
+assert( not bson.encode( { f = print },true ) )
+local stats = bson.stats()
+assert( stats.enabled and stats.encode.calls == 2 and stats.encode.errors == 1 )
+assert( stats.decode.calls == 1 and stats.decode.bytes == stats.encode.bytes )
+assert( stats.encode.errors_by_kind.type == 1 and stats.encode.errors_by_kind.depth == 0 )
+local depth_count = 0
+for _,count in ipairs( stats.depth ) do depth_count = depth_count + count end
+assert( depth_count == 2 )
+assert( stats.alloc.count > 0 )
+bson.enable_stats( false )
+
+-- encoder and writer hold libbson memory,release them to switch backend
+encoder,writer = nil,nil
+collectgarbage( "collect" )
+for _,backend in ipairs( { "pool","lua","system" } ) do
+    assert( bson.memory( backend ) == backend )
+    local mem_encoder = bson.encoder()
+    assert( bson.decode( mem_encoder:encode( tbl ) ).employees[1].lastName )
+    assert( not pcall( bson.memory,"system" == backend and "pool" or "system" ) )
+    mem_encoder = nil
+    collectgarbage( "collect" )
+end
+
+local batch_docs = {}
+for i = 1,2000 do batch_docs[i] = bson.encode( { index = i,tbl = tbl } ) end
+local batch = bson.decode_batch( table.concat( batch_docs ),false,4 )
+assert( #batch == 2000 and batch[2000].index == 2000 )
+assert( batch[1000].tbl.employees[3].firstName == "Thomas" )
+assert( not bson.decode_batch( batch_docs[1] .. "bad",true ) )
+
+local async_tbls = {}
+for i = 1,100 do async_tbls[i] = { index = i,tbl = tbl,list = { i,i + 1 } } end
+local job = bson.encode_async( async_tbls,false,nil,4 )
+async_tbls[1].index = -1 -- snapshot is taken already
+local async_stream = job:result()
+assert( job:done() )
+for i,doc in ipairs( bson.decode_all( async_stream ) ) do
+    assert( doc.index == i and doc.list[2] == i + 1 )
+    assert( doc.tbl.employees[2].firstName == "George" )
+end
+job = bson.encode_async( async_tbls,false,"test_async.bson" )
+assert( job:result() == string.len( async_stream ) )
+assert( #bson.decode_all( "test_async.bson","mmap" ) == 100 )
+job = nil
+os.remove( "test_async.bson" )
+local nul_job = bson.encode_async( { { a = 1 },{ ["a\0b"] = 1 } } )
+local nul_buffer,nul_err = nul_job:result( true )
+assert( not nul_buffer and string.find( nul_err,"#2 invalid key",1,true ) )
+
+local bad_utf8 = bson.encode( { s = "\xff\xfe" } )
+assert( bson.decode( bad_utf8 ).s == "\xff\xfe" )
+assert( not bson.decode( bad_utf8,true,nil,nil,{ validate = true } ) )
+assert( not bson.decode( bson.encode( { ["\xc0\xaf"] = 1 } ),
+    true,nil,nil,{ validate = true } ) )
+assert( not bson.decode( bson.encode( { s = "\xed\xa0\x80" } ),
+    true,nil,nil,{ validate = true } ) )
+local good_utf8 = { s = "中文ü",[ "键" ] = string.rep( "a",100 ) .. "é" }
+local decoded_utf8 = bson.decode( bson.encode( good_utf8 ),false,nil,nil,
+    { validate = true } )
+assert( decoded_utf8.s == good_utf8.s and decoded_utf8["键"] == good_utf8["键"] )
+
+local typed = {
+    id = bson.value( "oid" ),
+    time = bson.value( "date",1500000000000 ),
+    ts = bson.value( "timestamp",100,2 ),
+    re = bson.value( "regex","^a.*","i" ),
+    dec = bson.value( "decimal128","1.25" ),
+    code = bson.value( "code","return 1" ),
+    min = bson.value( "minkey" ),
+    max = bson.value( "maxkey" ),
+}
+local typed_buffer = bson.encode( typed )
+local untyped = bson.decode( typed_buffer )
+assert( type( untyped.id ) == "string" and string.len( untyped.id ) == 24 )
+assert( untyped.time == 1500000000000 )
+assert( untyped.ts == typed.ts and untyped.re == typed.re )
+assert( untyped.dec:value() == "1.25" and untyped.min:type() == "minkey" )
+assert( tostring( untyped.ts ) == "timestamp(100,2)" )
+local decoded_typed = bson.decode( typed_buffer,false,nil,nil,{ typed = true } )
+assert( string.len( decoded_typed.id:value() ) == 12 )
+assert( decoded_typed.id == typed.id and decoded_typed.time == typed.time )
+assert( bson.value( "oid",tostring( typed.id ):sub( 5,28 ) ) == typed.id )
+local round_trip = bson.decode( bson.encode( decoded_typed ),false,nil,nil,
+    { typed = true } )
+for k,v in pairs( typed ) do assert( round_trip[k] == v ) end
+local async_typed = bson.encode_async( { typed } ):result()
+assert( bson.decode( async_typed ).re:value() == "^a.*" )
+assert( not pcall( bson.value,"oid","bad" ) )
+local bin = bson.value( "binary","\0\1",5 )
+local bin_buffer = bson.encode( { bin = bin } )
+assert( bson.decode( bin_buffer ).bin == "\0\1" )
+local typed_bin = bson.decode( bin_buffer,false,nil,nil,{ typed = true } ).bin
+assert( typed_bin == bin and typed_bin:type() == "binary" )
+assert( select( 2,typed_bin:value() ) == 5 )
+assert( select( 2,bson.value( "binary","x" ):value() ) == 0 )
+
+local deep = {}
+local deep_node = deep
+for i = 1,600 do deep_node.sub = { i }; deep_node = deep_node.sub end
+assert( not bson.encode( deep,true ) )
+local old_depth = bson.max_depth( 1000 )
+assert( old_depth == 512 and bson.max_depth() == 1000 )
+local deep_decoded = bson.decode( bson.encode( deep ) )
+for i = 1,600 do deep_decoded = deep_decoded.sub; assert( deep_decoded[1] == i ) end
+local deep_buffer = bson.encode( deep )
+local deep_batch = bson.decode_batch( deep_buffer .. deep_buffer,false,2 )
+assert( #deep_batch == 2 and deep_batch[2].sub.sub.sub[1] == 3 )
+bson.max_depth( old_depth )
+local _,deep_err = bson.decode_batch( deep_buffer,true )
+assert( string.find( deep_err,"too deep" ) )
+bson.max_depth( 100 )
+local _,async_err = bson.encode_async( { deep },true )
+assert( string.find( async_err,"too deep" ) )
+local deep_codec = bson.compile( { sub = { sub = "any" } } )
+assert( not deep_codec:encode( deep,true ) )
+assert( not deep_codec:decode( deep_buffer,true ) )
+bson.max_depth( old_depth )
+
+local patch_src = { a = { b = 1,s = "abc" },list = { 1,2,3 },n = 1.5 }
+local patched = bson.decode( bson.patch( bson.encode( patch_src ),{
+    ["a.b"] = 5, ["a.s"] = "xyz", ["list.1"] = "long string", n = 2.5,
+    ["a.new"] = { 1,2 } } ) )
+assert( patched.a.b == 5 and patched.a.s == "xyz" and patched.n == 2.5 )
+assert( patched.list[2] == "long string" and patched.list[3] == 3 )
+assert( patched.a.new[2] == 2 )
+assert( not bson.patch( bson.encode( patch_src ),{ ["x.y"] = 1 },true ) )
+local patch_buf = bson.buffer( 256 )
+local patch_len = bson.encode_into( patch_buf,0,patch_src )
+assert( bson.patch( patch_buf,{ ["a.s"] = "abcdef" } ) == patch_len + 3 )
+assert( bson.decode_from( patch_buf ).a.s == "abcdef" )
+
+local diff_old = { hp = 100,pos = { x = 1,y = 2 },bag = { 1,2,3 },name = "a" }
+local diff_new = { hp = 90,pos = { x = 1,y = 3 },bag = { 1,2 },buff = true }
+local diff_old_buf = bson.encode( diff_old )
+local delta = bson.decode( bson.diff( diff_old_buf,bson.encode( diff_new ) ) )
+assert( delta["$set"].hp == 90 and delta["$set"]["pos.y"] == 3 )
+assert( delta["$set"].buff == true and delta["$set"]["pos.x"] == nil )
+assert( delta["$unset"].name and delta["$unset"]["bag.2"] )
+local applied = bson.decode( bson.apply( diff_old_buf,
+    bson.diff( diff_old_buf,bson.encode( diff_new ) ) ) )
+assert( applied.hp == 90 and applied.pos.y == 3 and applied.buff == true )
+assert( applied.name == nil and #applied.bag == 2 )
+assert( bson.diff( diff_old_buf,diff_old_buf ) == bson.encode( {} ) )
+local wide_old,wide_new = {},{}
+for i = 1,300 do wide_old["k" .. i] = i; wide_new["k" .. i] = i end
+wide_new.k7,wide_new.k299 = nil,nil
+wide_new.k150 = -1
+local wide_delta = bson.decode(
+    bson.diff( bson.encode( wide_old ),bson.encode( wide_new ) ) )
+local wide_unset = 0
+for _ in pairs( wide_delta["$unset"] ) do wide_unset = wide_unset + 1 end
+assert( wide_delta["$set"].k150 == -1 and wide_unset == 2 )
+assert( wide_delta["$unset"].k7 and wide_delta["$unset"].k299 )
+local dot_old = bson.encode( { a = { ["b.c"] = 1,d = 2 } } )
+local dot_new = bson.encode( { a = { ["b.c"] = 3,d = 2 } } )
+local dot_delta = bson.decode( bson.diff( dot_old,dot_new ) )
+assert( dot_delta["$set"].a["b.c"] == 3 and dot_delta["$set"]["a.b.c"] == nil )
+assert( bson.decode( bson.apply( dot_old,bson.diff( dot_old,dot_new ) ) ).a["b.c"] == 3 )
+assert( not bson.diff( bson.encode( { ["x.y"] = 1 } ),dot_new,true ) )
+local chain_old,chain_new = {},{}
+local chain_a,chain_b = chain_old,chain_new
+for _ = 1,40 do
+    chain_a.s,chain_b.s = {},{}
+    chain_a,chain_b = chain_a.s,chain_b.s
+end
+chain_a.v,chain_b.v = 1,2
+local chain_buf = bson.encode( chain_old )
+local chain_apply = bson.decode( bson.apply( chain_buf,
+    bson.diff( chain_buf,bson.encode( chain_new ) ) ) )
+for _ = 1,40 do chain_apply = chain_apply.s end
+assert( chain_apply.v == 2 )
+
+local template = { id = 1001,attrs = { 1,2,3 } }
+local graph = { a = template,b = template,list = { template,template } }
+graph.self = graph
+assert( not bson.encode( graph,true ) )
+assert( not bson.encode( graph,true,{ refs = true,strict = true } ) )
+local graph_buf = bson.encode( graph,false,{ refs = true } )
+local graph_decoded = bson.decode( graph_buf,false,nil,nil,{ refs = true } )
+assert( graph_decoded.a == graph_decoded.b and graph_decoded.self == graph_decoded )
+assert( graph_decoded.list[1] == graph_decoded.a and graph_decoded.a.attrs[3] == 3 )
+graph.self = nil
+bson.enable_stats( true )
+bson.reset_stats()
+local _,cycle_err = bson.encode( { x = { y = graph_decoded } },true,{ strict = true } )
+assert( string.find( cycle_err,"x.y.self",1,true ) )
+assert( bson.stats().encode.errors_by_kind.cycle == 1 )
+bson.enable_stats( false )
+assert( #bson.encode( graph,false,{ refs = true } ) < #bson.encode( graph ) )
+
+local canon_a,canon_b = {},{}
+for i = 1,20 do canon_a["k" .. i] = i end
+for i = 20,1,-1 do canon_b["k" .. i] = i end
+canon_a.sub = { z = 1,a = { y = 2,b = 3 } }
+canon_b.sub = { a = { b = 3,y = 2 },z = 1 }
+local canon_buf_a,_,canon_hash_a = bson.encode( canon_a,false,{ canonical = true } )
+local canon_buf_b,_,canon_hash_b = bson.encode( canon_b,false,{ canonical = true } )
+assert( canon_buf_a == canon_buf_b and canon_hash_a == canon_hash_b )
+assert( math.type( canon_hash_a ) == "integer" )
+local canon_keys = {}
+for k in pairs( bson.lazy( canon_buf_a ) ) do table.insert( canon_keys,k ) end
+for i = 2,#canon_keys do assert( canon_keys[i - 1] < canon_keys[i] ) end
+assert( bson.encode( canon_a,false,{ canonical = true } ) == canon_buf_a )